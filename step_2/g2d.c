@@ -4,8 +4,38 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
-
-/*2d gravity*/
+#include <complex.h>
+#include <pthread.h>
+#ifdef USE_MPI
+#include <mpi.h>
+#endif
+
+/*2d gravity, 3d when built with -DDIM=3*/
+
+#ifndef DIM
+#define DIM 2
+#endif
+#if DIM != 2 && DIM != 3
+#error "DIM must be 2 or 3"
+#endif
+
+//third coordinate only exists in 3D builds
+#if DIM == 3
+#define Z(...) __VA_ARGS__
+#else
+#define Z(...)
+#endif
+
+//precision of the pairwise force kernel; state, position differences,
+//integration and accumulations always stay in double. -DREAL_FLOAT doubles
+//the SIMD width of the distance and force math.
+#ifdef REAL_FLOAT
+typedef float real;
+#define real_sqrt sqrtf
+#else
+typedef double real;
+#define real_sqrt sqrt
+#endif
 
 #define NAMELEN 16
 struct body {
@@ -14,46 +44,684 @@ struct body {
     double  rx,ry;      //pos in meters
     double  vx,vy;      //speed in m/sec
     double  ax,ay;      //accels in m/sec^2
+    double  kx,ky;      //part of accel due to the dominant attractor
+#if DIM == 3
+    double  rz,vz,az,kz;
+#endif
+    int     prim;       //dominant attractor index, -1 if none
+    int     rel;        //index the state is relative to while BODY_REL
+    int     atmo;       //atmosphere index, -1 if none
+    int     around;     //id of the body the ship was positioned around, -1 if none
+    uint32_t id;        //stable identifier (creation order), index may change
+    double  bc;         //ballistic coefficient m/(Cd.A) in kg/m^2, 0 = no drag
+    uint32_t flags;     //BODY_xxx
     char    name[NAMELEN];
 };
 
+#define BODY_SHIP   0x01    //defined by a ship line
+#define BODY_REL    0x02    //state temporarily relative to body rel (regularized or encke step)
+
 #define PLOT_POS    0x01
 #define PLOT_VEL    0x02
 #define PLOT_ACC    0x04
 #define PLOT_ORB    0x08
 
+#define PLOT_MAXCOL 16
+
+/*
+ * trajectory archive (.gra): samples are stored in blocks of ARC_BLOCK rows.
+ * Each double is XORed with its prediction, a polynomial extrapolation of
+ * the previous rows of the same column, then bit packed as in Gorilla:
+ *   0                          : exact prediction
+ *   10 bits                    : meaningful bits fit the column previous window
+ *   11 lz(6) len-1(6) bits     : new window, lz leading zeros, len bits
+ * A block starts with the polynomial degree of each column (2 bits, the one
+ * packing it best), then the columns one after the other, windows start
+ * empty. Blocks decode on their own. A time index of the blocks at the end
+ * of file lets a reader seek to any time with a bisection and decode only
+ * the blocks it needs. Native byte order.
+ *   header: "GRA2" ncol(u32) blockrows(u32)
+ *   blocks: nrows(u32) nbytes(u32) payload
+ *   index : per block t0(double) offset(u64)
+ *   footer: index offset(u64) nblocks(u32) "GRA2"
+ */
+#define ARC_MAGIC   "GRA2"
+#define ARC_MAXDEG  3
+#define ARC_BLOCK   256
+
+struct arc {
+    uint32_t    ncol;
+    uint32_t    nrows;      //rows buffered in the current block
+    double      *rows;      //ARC_BLOCK * ncol
+    uint8_t     *buf;       //encoded block
+    double      *it;        //index: block start times
+    uint64_t    *ioff;      //index: block offsets
+    uint32_t    nblocks;
+    uint32_t    isize;
+    uint64_t    total;      //rows written, to report the compression
+};
+
+//worst case encoded block size: 2+6+6+64 bits per value
+#define ARC_BUFSIZE(ncol)   (10 * ARC_BLOCK * (ncol) + 8)
+
 struct plot {
-    struct body *sat;   //body to consider as satellite
-    struct body *ref;   //body to consider as center (ref)
+    uint32_t sat;   //id of body to consider as satellite
+    uint32_t ref;   //id of body to consider as center (ref)
     uint32_t plots; //bitmap of coordinates to plot
     uint32_t    nth; //skip steps
     char name[256];
     FILE *f;
+    struct arc *arc; //archive output, NULL for text
+};
+
+struct diag {
+    uint32_t        nth;    //report every nth step, 0 = disabled
+    double          m;      //total mass
+    double          ke,pe;  //kinetic and potential energy
+    double          px,py;  //linear momentum
+    double          lz;     //angular momentum, 2D means a single value along Z
+    double          cx,cy;  //centre of mass
+#if DIM == 3
+    double          pz,lx,ly,cz;
+#endif
+    double          e0,l0;  //reference energy and angular momentum (first sample)
+    double          de,dl;  //worst relative drift seen so far
+    unsigned long   samples;
+};
+
+//atmospheric density resampled on a uniform altitude grid, stored as log
+//so that interpolation is linear and the lookup needs no search nor branch
+#define ATMO_VACUUM -700.0  //log density above the top, exp() of it is ~0
+
+struct atmo {
+    double  top;        //altitude of the last sample, meters
+    double  inv;        //1 / grid spacing
+    int     n;          //grid intervals, table holds n+3 values (2 vacuum guards)
+    double  *lrho;      //log of density in kg/m^3
+    uint32_t body;      //id of the planet it surrounds
+};
+
+#define FRAME_PROGRADE  0
+#define FRAME_RETROGRADE 1
+#define FRAME_RADIAL    2
+#define FRAME_ANTIRADIAL 3
+
+struct burn {
+    int     ship;       //thrusting body id
+    int     ref;        //id of the body defining the frame
+    double  start;      //seconds
+    double  duration;   //seconds, 0 = impulsive
+    double  dv;         //total delta-v in m/sec
+    int     frame;      //FRAME_xxx
+};
+
+#define EVENT_START 0
+#define EVENT_END   1
+
+struct event {
+    double  t;          //event time
+    int     burn;       //burn index
+    int     type;       //EVENT_xxx
 };
 
+//binary min-heap of events ordered by time
+struct queue {
+    struct event    *ev;
+    int             count;
+    int             size;
+};
+
+struct parareal {
+    int             slices; //time slices propagated concurrently, 0 = disabled
+    int             coarse; //coarse propagator step, in fine steps
+    double          tol;    //convergence on position change, relative to each body reference
+    int             maxiter;
+};
+
+//encke propagation of a ship: deviation from a reference conic around
+//the body the ship was positioned around, all relative to that body
+struct encke {
+    int     init;       //reference conic set
+    double  t0;         //reference epoch
+    double  rx,ry;      //reference position at epoch
+    double  vx,vy;      //reference velocity at epoch
+    double  dx,dy;      //position deviation from the reference
+    double  dvx,dvy;    //velocity deviation from the reference
+#if DIM == 3
+    double  rz,vz,dz,dvz;
+#endif
+};
+
+//contiguous copy of positions (double) and G.mass (kernel precision) of
+//all bodies, by index, so the inner loop only streams flat arrays. This is
+//all a process knows of the bodies it does not hold: positions are refreshed
+//each step, G.mass and radius do not change and only follow a reorder.
+struct kernel {
+    double          *x,*y;  //positions stay in double, differences are narrowed
+#if DIM == 3
+    double          *z;
+#endif
+    real            *gm;
+    double          *rad;   //radius, for collisions
+    double          *pe;    //potential per unit mass, always summed, read by diag
+};
+
+struct mkey {
+    uint64_t    key;    //morton code of the body position
+    uint32_t    i;      //body index
+};
+
+#ifdef USE_MPI
+//distributed mode: every process holds, computes and integrates its own
+//block of bodies. Only positions are exchanged each step, into the kernel.
+//Bodies looked up by id (plots, burns, atmospheres, reference bodies) are
+//shared: their owner also sends their whole record to every process.
+struct dist {
+    int             rank;
+    int             size;
+    int             *counts;    //bodies owned by each process
+    int             *displs;
+    MPI_Datatype    pos;        //position of a body, DIM doubles
+    MPI_Datatype    rec;        //whole body record
+    MPI_Datatype    erec;       //encke record
+    MPI_Request     req;
+    double          *send;      //own positions being sent
+    double          *recv;      //all positions being received
+    uint32_t        *shared;    //ids of the shared bodies
+    int             scount;
+    struct body     *srecv;     //shared records being received
+    int             *scounts;   //shared bodies owned by each process
+    int             *sdispls;
+};
+#endif
+
+#define NOLOC UINT32_MAX
+
 struct state {
-    struct body     *bodies;
-    int             bcount;
+    struct body     *bodies;//held bodies: own block, then copies of shared bodies
+    int             bcount; //bodies in the simulation
+    int             nloc;   //bodies held by this process
+    uint32_t        *idx;   //body id -> index
+    uint32_t        *loc;   //index -> slot in bodies, NOLOC if not held
+    uint32_t        reorder;//space-filling curve reordering every nth step, 0 = never
     double          t;      //current time
     double          tmax;   //max sim duration
     double          dt;     //time step
+    double          h;      //current step, dt clipped to land on the next event
+    double          tclip;  //time a clipped step lands on
     unsigned long   steps;  //step count
     struct plot     *plots;
     int             pcount;
+    struct diag     diag;   //conserved quantities tracking
+    double          reg;    //regularize ships whose periapsis is closer than reg steps, 0 = disabled
+    struct atmo     *atmos;
+    int             acount;
+    struct burn     *burns;
+    int             brcount;
+    struct queue    events; //pending burn starts and ends
+    int             *active;//burns currently thrusting
+    int             actcount;
+    struct parareal para;
+    int             clone;  //parareal slice: silent, collisions do not end the run
+    int             hit;    //parareal slice: a collision happened, see sim_parareal
+    struct encke    *encke; //per own body, NULL when encke is disabled
+    double          rectify;//encke: new reference when deviation exceeds rectify * distance
+    struct kernel   kern;
+    uint32_t        lo,hi;  //bodies computed and integrated by this process
+    int             stale;  //step ended but bodies not synced yet, see sim_sync
+#ifdef USE_MPI
+    struct dist     dist;
+#endif
 };
 
 struct state sim;
 
 #define G 6.6743015E-11
 
+/*---------------------------------------------------------------------------*/
+static inline uint64_t arc_bits(double v) {
+    uint64_t b;
+    memcpy(&b, &v, sizeof(b));
+    return b;
+}
+
+/*---------------------------------------------------------------------------*/
+static inline double arc_double(uint64_t b) {
+    double v;
+    memcpy(&v, &b, sizeof(v));
+    return v;
+}
+
+/*---------------------------------------------------------------------------*/
+//prediction of row r of a column from the previous rows of the same block,
+//extrapolating a polynomial of degree deg (Newton backward differences).
+//Only additions, so that no FMA contraction changes it between builds.
+static inline double arc_predict(const double *rows, uint32_t ncol, uint32_t r, uint32_t c, int deg) {
+    double d[ARC_MAXDEG+1],p;
+    int i,j;
+    if(!r) {
+        return 0;
+    }
+    if(deg > (int)r - 1) {
+        deg = r - 1;
+    }
+    for(i = 0; i <= deg; i++) {
+        d[i] = rows[(r-1-i)*ncol + c];
+    }
+    p = d[0];
+    for(j = 1; j <= deg; j++) {
+        for(i = 0; i <= deg - j; i++) {
+            d[i] = d[i] - d[i+1];
+        }
+        p += d[0];
+    }
+    return p;
+}
+
+/*---------------------------------------------------------------------------*/
+//append the n low bits of v to buf at bit position *pos, most significant first
+static inline void arc_put(uint8_t *buf, uint32_t *pos, uint64_t v, int n) {
+    int room,k;
+    while(n > 0) {
+        room = 8 - (*pos & 7);
+        k = n < room ? n : room;
+        if(room == 8) {
+            buf[*pos >> 3] = 0;
+        }
+        buf[*pos >> 3] |= ((v >> (n - k)) & ((1u << k) - 1)) << (room - k);
+        *pos += k;
+        n -= k;
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+//read n bits at bit position *pos, bits past end read as zeros
+static inline uint64_t arc_get(const uint8_t *buf, uint32_t *pos, int n, uint32_t end) {
+    uint64_t v;
+    int room,k;
+    v = 0;
+    while(n > 0) {
+        room = 8 - (*pos & 7);
+        k = n < room ? n : room;
+        v <<= k;
+        if(*pos < end) {
+            v |= (buf[*pos >> 3] >> (room - k)) & ((1u << k) - 1);
+        }
+        *pos += k;
+        n -= k;
+    }
+    return v;
+}
+
+/*---------------------------------------------------------------------------*/
+struct arc *arc_open(FILE *f, uint32_t ncol) {
+    struct arc *a;
+    uint32_t hdr[2];
+    a = calloc(1, sizeof(struct arc));
+    if(!a) {
+        return NULL;
+    }
+    a->ncol = ncol;
+    a->rows = malloc(sizeof(double) * ARC_BLOCK * ncol);
+    a->buf  = malloc(ARC_BUFSIZE(ncol));
+    if(!a->rows || !a->buf) {
+        free(a->rows);
+        free(a->buf);
+        free(a);
+        return NULL;
+    }
+    hdr[0] = ncol;
+    hdr[1] = ARC_BLOCK;
+    fwrite(ARC_MAGIC, 1, 4, f);
+    fwrite(hdr, sizeof(uint32_t), 2, f);
+    return a;
+}
+
+/*---------------------------------------------------------------------------*/
+//bit pack one column of the buffered rows, predicted with degree deg.
+//Only counts the bits when buf is NULL. Returns the bit position.
+static uint32_t arc_code_column(const struct arc *a, uint32_t c, int deg, uint8_t *buf, uint32_t n) {
+    uint32_t r,cnt;
+    uint64_t x;
+    int lz,tz,len,wlz,wlen;
+
+    cnt = n;
+    wlz = wlen = 0;
+    for(r = 0; r < a->nrows; r++) {
+        x = arc_bits(a->rows[r*a->ncol + c]) ^ arc_bits(arc_predict(a->rows, a->ncol, r, c, deg));
+        if(!x) {
+            if(buf) arc_put(buf, &n, 0, 1);
+            cnt += 1;
+            continue;
+        }
+        lz = __builtin_clzll(x);
+        tz = __builtin_ctzll(x);
+        len = 64 - lz - tz;
+        //the window is kept only while it is cheaper than a new tight one
+        if(wlen && lz >= wlz && 64 - tz <= wlz + wlen && wlen <= len + 12) {
+            if(buf) {
+                arc_put(buf, &n, 2, 2);
+                arc_put(buf, &n, x >> (64 - wlz - wlen), wlen);
+            }
+            cnt += 2 + wlen;
+            continue;
+        }
+        wlz = lz;
+        wlen = len;
+        if(buf) {
+            arc_put(buf, &n, 3, 2);
+            arc_put(buf, &n, lz, 6);
+            arc_put(buf, &n, len - 1, 6);
+            arc_put(buf, &n, x >> tz, len);
+        }
+        cnt += 14 + len;
+    }
+    return cnt;
+}
+
+/*---------------------------------------------------------------------------*/
+//encode and write the buffered rows as one block, each column with the
+//predictor degree that packs it best
+int arc_flush(struct arc *a, FILE *f) {
+    uint32_t c,hdr[2],n,bits,best;
+    int deg,bdeg[PLOT_MAXCOL];
+
+    if(!a->nrows) {
+        return 0;
+    }
+    if(a->nblocks == a->isize) {
+        a->isize = a->isize ? a->isize * 2 : 64;
+        a->it   = realloc(a->it, sizeof(double) * a->isize);
+        a->ioff = realloc(a->ioff, sizeof(uint64_t) * a->isize);
+        if(!a->it || !a->ioff) {
+            return 1;
+        }
+    }
+    a->it[a->nblocks] = a->rows[0];
+    a->ioff[a->nblocks] = ftell(f);
+    a->nblocks += 1;
+    a->total += a->nrows;
+
+    n = 0;
+    for(c = 0; c < a->ncol; c++) {
+        bdeg[c] = 0;
+        best = arc_code_column(a, c, 0, NULL, 0);
+        for(deg = 1; deg <= ARC_MAXDEG; deg++) {
+            bits = arc_code_column(a, c, deg, NULL, 0);
+            if(bits < best) {
+                best = bits;
+                bdeg[c] = deg;
+            }
+        }
+        arc_put(a->buf, &n, bdeg[c], 2);
+    }
+    for(c = 0; c < a->ncol; c++) {
+        n = arc_code_column(a, c, bdeg[c], a->buf, n);
+    }
+    n = (n + 7) / 8;
+    hdr[0] = a->nrows;
+    hdr[1] = n;
+    fwrite(hdr, sizeof(uint32_t), 2, f);
+    fwrite(a->buf, 1, n, f);
+    a->nrows = 0;
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+int arc_append(struct arc *a, FILE *f, const double *row) {
+    memcpy(&a->rows[a->nrows * a->ncol], row, sizeof(double) * a->ncol);
+    a->nrows += 1;
+    if(a->nrows == ARC_BLOCK) {
+        return arc_flush(a, f);
+    }
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+//flush, write the time index and release the archive, f stays open
+int arc_close(struct arc *a, FILE *f) {
+    uint64_t off;
+    uint32_t i;
+    arc_flush(a, f);
+    off = ftell(f);
+    for(i = 0; i < a->nblocks; i++) {
+        fwrite(&a->it[i], sizeof(double), 1, f);
+        fwrite(&a->ioff[i], sizeof(uint64_t), 1, f);
+    }
+    fwrite(&off, sizeof(uint64_t), 1, f);
+    fwrite(&a->nblocks, sizeof(uint32_t), 1, f);
+    fwrite(ARC_MAGIC, 1, 4, f);
+    free(a->rows);
+    free(a->buf);
+    free(a->it);
+    free(a->ioff);
+    free(a);
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+//decode one block at the current file position into rows, returns row count
+int arc_read_block(FILE *f, uint32_t ncol, double *rows, uint8_t *buf) {
+    uint32_t r,c,hdr[2],n,end;
+    uint64_t x;
+    int wlz,wlen,deg[PLOT_MAXCOL];
+
+    if(fread(hdr, sizeof(uint32_t), 2, f) != 2 || hdr[0] > ARC_BLOCK || hdr[1] > ARC_BUFSIZE(ncol)) {
+        return -1;
+    }
+    if(fread(buf, 1, hdr[1], f) != hdr[1]) {
+        return -1;
+    }
+    end = hdr[1] * 8;
+    n = 0;
+    for(c = 0; c < ncol; c++) {
+        deg[c] = arc_get(buf, &n, 2, end);
+    }
+    for(c = 0; c < ncol; c++) {
+        wlz = wlen = 0;
+        for(r = 0; r < hdr[0]; r++) {
+            x = 0;
+            if(arc_get(buf, &n, 1, end)) {
+                if(arc_get(buf, &n, 1, end)) {
+                    wlz = arc_get(buf, &n, 6, end);
+                    wlen = arc_get(buf, &n, 6, end) + 1;
+                    if(wlz + wlen > 64) {
+                        return -1;
+                    }
+                } else if(!wlen) {
+                    return -1;
+                }
+                x = arc_get(buf, &n, wlen, end) << (64 - wlz - wlen);
+            }
+            rows[r*ncol + c] = arc_double(x ^ arc_bits(arc_predict(rows, ncol, r, c, deg[c])));
+        }
+    }
+    if(n > end) {
+        return -1;
+    }
+    return hdr[0];
+}
+
+/*---------------------------------------------------------------------------*/
+//print the samples of an archive between t0 and t1 as plot text lines
+int arc_query(const char *fname, double t0, double t1) {
+    FILE *f;
+    char magic[4];
+    uint32_t hdr[2],nblocks,ncol,lo,hi,mid,c;
+    uint64_t off;
+    double *it,*rows;
+    uint64_t *ioff;
+    uint8_t *buf;
+    int n,r,ret;
+
+    f = fopen(fname, "rb");
+    if(!f) {
+        printf("cant open: %s\n", fname);
+        return 1;
+    }
+    ret = 1;
+    it = NULL;
+    ioff = NULL;
+    rows = NULL;
+    buf = NULL;
+    if(fread(magic, 1, 4, f) != 4 || memcmp(magic, ARC_MAGIC, 4) ||
+       fread(hdr, sizeof(uint32_t), 2, f) != 2 || hdr[1] != ARC_BLOCK ||
+       !hdr[0] || hdr[0] > PLOT_MAXCOL) {
+        printf("%s: not an archive\n", fname);
+        goto done;
+    }
+    ncol = hdr[0];
+    fseek(f, -16, SEEK_END);
+    if(fread(&off, sizeof(uint64_t), 1, f) != 1 || fread(&nblocks, sizeof(uint32_t), 1, f) != 1 ||
+       fread(magic, 1, 4, f) != 4 || memcmp(magic, ARC_MAGIC, 4)) {
+        printf("%s: truncated archive\n", fname);
+        goto done;
+    }
+    it   = malloc(sizeof(double) * (nblocks + 1));
+    ioff = malloc(sizeof(uint64_t) * (nblocks + 1));
+    rows = malloc(sizeof(double) * ARC_BLOCK * ncol);
+    buf  = malloc(ARC_BUFSIZE(ncol));
+    if(!it || !ioff || !rows || !buf) {
+        goto done;
+    }
+    fseek(f, off, SEEK_SET);
+    for(c = 0; c < nblocks; c++) {
+        if(fread(&it[c], sizeof(double), 1, f) != 1 || fread(&ioff[c], sizeof(uint64_t), 1, f) != 1) {
+            printf("%s: truncated index\n", fname);
+            goto done;
+        }
+    }
+
+    //last block starting at or before t0
+    lo = 0;
+    hi = nblocks;
+    while(hi - lo > 1) {
+        mid = (lo + hi) / 2;
+        if(it[mid] <= t0) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    ret = 0;
+    for(c = lo; c < nblocks && it[c] <= t1; c++) {
+        fseek(f, ioff[c], SEEK_SET);
+        n = arc_read_block(f, ncol, rows, buf);
+        if(n < 0) {
+            printf("%s: corrupted block %u\n", fname, c);
+            ret = 1;
+            break;
+        }
+        for(r = 0; r < n; r++) {
+            uint32_t k;
+            if(rows[r*ncol] < t0 || rows[r*ncol] > t1) continue;
+            for(k = 0; k < ncol; k++) {
+                printf("%.17g ", rows[r*ncol + k]);
+            }
+            printf("\n");
+        }
+    }
+
+done:
+    free(it);
+    free(ioff);
+    free(rows);
+    free(buf);
+    fclose(f);
+    return ret;
+}
+
+/*---------------------------------------------------------------------------*/
+int plot_is_archive(const char *name) {
+    size_t len = strlen(name);
+    return len > 4 && !strcmp(name + len - 4, ".gra");
+}
+
+/*---------------------------------------------------------------------------*/
+//columns of a plot row, time included
+uint32_t plot_columns(uint32_t plots) {
+    uint32_t n = 1;
+    if(plots & PLOT_POS) n += DIM;
+    if(plots & PLOT_VEL) n += DIM;
+    if(plots & PLOT_ACC) n += DIM;
+    if(plots & PLOT_ORB) n += 4;
+    return n;
+}
+
+/*---------------------------------------------------------------------------*/
+//body by index, which this process must hold
+static inline struct body *sim_at(struct state *s, uint32_t u) {
+    return &s->bodies[s->loc[u]];
+}
+
+/*---------------------------------------------------------------------------*/
+//body by id, valid once the simulation is started
+static inline struct body *sim_body(struct state *s, uint32_t id) {
+    return sim_at(s, s->idx[id]);
+}
+
+/*---------------------------------------------------------------------------*/
+int sim_kernel_alloc(struct kernel *k, int n) {
+    k->x  = malloc(sizeof(double) * n);
+    k->y  = malloc(sizeof(double) * n);
+    Z(k->z = malloc(sizeof(double) * n);)
+    k->gm = malloc(sizeof(real) * n);
+    k->rad = malloc(sizeof(double) * n);
+    k->pe = malloc(sizeof(double) * n);
+    return !k->x || !k->y Z(|| !k->z) || !k->gm || !k->rad || !k->pe;
+}
+
+/*---------------------------------------------------------------------------*/
+void sim_kernel_free(struct kernel *k) {
+    free(k->x);
+    free(k->y);
+    Z(free(k->z);)
+    free(k->gm);
+    free(k->rad);
+    free(k->pe);
+}
+
+/*---------------------------------------------------------------------------*/
+//whole kernel from the bodies, while this process still holds all of them
+void sim_kernel_init(struct state *s) {
+    struct kernel *k = &s->kern;
+    int u;
+    for(u = 0; u < s->bcount; u++) {
+        k->x[u]   = s->bodies[u].rx;
+        k->y[u]   = s->bodies[u].ry;
+        Z(k->z[u] = s->bodies[u].rz;)
+        k->gm[u]  = G * s->bodies[u].mass;
+        k->rad[u] = s->bodies[u].radius;
+    }
+}
+
 /*---------------------------------------------------------------------------*/
 int sim_init(struct state *dest) {
     dest->bodies = NULL;
     dest->bcount = 0;
+    dest->nloc = 0;
+    dest->idx = NULL;
+    dest->loc = NULL;
+    dest->reorder = 0;
     dest->plots = NULL;
     dest->pcount = 0;
     dest->tmax = 0;
     dest->dt = 0;
+    dest->reg = 0;
+    dest->atmos = NULL;
+    dest->acount = 0;
+    dest->burns = NULL;
+    dest->brcount = 0;
+    memset(&dest->events, 0, sizeof(struct queue));
+    dest->active = NULL;
+    dest->actcount = 0;
+    memset(&dest->para, 0, sizeof(struct parareal));
+    dest->clone = 0;
+    dest->encke = NULL;
+    dest->rectify = 0;
+    memset(&dest->diag, 0, sizeof(struct diag));
+    memset(&dest->kern, 0, sizeof(struct kernel));
     return 0;
 }
 
@@ -62,23 +730,377 @@ int sim_end(struct state *dest) {
     int p;
     for(p=0;p<dest->pcount;p++) {
         if(dest->plots[p].f) {
+            if(dest->plots[p].arc) {
+                double raw = 8.0 * dest->plots[p].arc->total * dest->plots[p].arc->ncol;
+                arc_close(dest->plots[p].arc, dest->plots[p].f);
+                printf("%s: %.2fx smaller than raw doubles\n", dest->plots[p].name,
+                    raw / ftell(dest->plots[p].f));
+            }
             fclose(dest->plots[p].f);
         }
     }
+    for(p=0;p<dest->acount;p++) {
+        free(dest->atmos[p].lrho);
+    }
+    free(dest->atmos);
+    free(dest->burns);
+    free(dest->events.ev);
+    free(dest->active);
     free(dest->plots);
     free(dest->bodies);
+    free(dest->idx);
+    free(dest->loc);
+    free(dest->encke);
+    sim_kernel_free(&dest->kern);
+#ifdef USE_MPI
+    free(dest->dist.counts);
+    free(dest->dist.displs);
+    free(dest->dist.send);
+    free(dest->dist.recv);
+    free(dest->dist.shared);
+    free(dest->dist.srecv);
+    free(dest->dist.scounts);
+    free(dest->dist.sdispls);
+    MPI_Type_free(&dest->dist.pos);
+    MPI_Type_free(&dest->dist.rec);
+    MPI_Type_free(&dest->dist.erec);
+#endif
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+//back to absolute coordinates once reference bodies have moved. A reference
+//body (attractor, encke reference) is never relative itself.
+static void sim_fixup(struct state *s) {
+    int u;
+    for(u = 0; u < s->nloc; u++) {
+        struct body *b = &s->bodies[u];
+        struct body *p;
+        if(!(b->flags & BODY_REL)) continue;
+        p = sim_at(s, b->rel);
+        b->rx += p->rx;
+        b->ry += p->ry;
+        b->vx += p->vx;
+        b->vy += p->vy;
+#if DIM == 3
+        b->rz += p->rz;
+        b->vz += p->vz;
+#endif
+        b->flags &= ~BODY_REL;
+    }
+}
+
+#ifdef USE_MPI
+/*---------------------------------------------------------------------------*/
+//process owning body index u, blocks are split as in sim_dist_start
+static inline int sim_dist_owner(const struct state *s, uint32_t u) {
+    return ((uint64_t)(u + 1) * s->dist.size - 1) / s->bcount;
+}
+
+/*---------------------------------------------------------------------------*/
+//bodies looked up by id, whatever the process integrating them
+static int sim_dist_shared(struct state *dest, uint8_t *mark) {
+    int i;
+    uint32_t u;
+    for(i = 0; i < dest->pcount; i++) {
+        mark[dest->plots[i].sat] = 1;
+        mark[dest->plots[i].ref] = 1;
+    }
+    for(i = 0; i < dest->brcount; i++) {
+        mark[dest->burns[i].ship] = 1;
+        if(dest->burns[i].ref >= 0) {
+            mark[dest->burns[i].ref] = 1;
+        }
+    }
+    for(i = 0; i < dest->acount; i++) {
+        mark[dest->atmos[i].body] = 1;
+    }
+    for(u = 0; u < (uint32_t)dest->bcount; u++) {
+        struct body *b = &dest->bodies[u];
+        //encke reference, any planet may be a regularization attractor
+        if(dest->rectify > 0 && b->around >= 0) {
+            mark[b->around] = 1;
+        }
+        if(dest->reg > 0 && !(b->flags & BODY_SHIP)) {
+            mark[u] = 1;
+        }
+    }
+    for(u = 0, i = 0; u < (uint32_t)dest->bcount; u++) {
+        i += mark[u];
+    }
+    return i;
+}
+
+/*---------------------------------------------------------------------------*/
+//split bodies in contiguous blocks, one per process. Each process then only
+//keeps its own block and the shared bodies, ids are still indices here.
+int sim_dist_start(struct state *dest) {
+    struct dist *d = &dest->dist;
+    struct body *nb;
+    uint8_t *mark;
+    int r,j,own;
+    uint32_t u,lo,hi;
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &d->rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &d->size);
+    //counted in bodies with derived datatypes: byte counts overflow an int
+    MPI_Type_contiguous(DIM, MPI_DOUBLE, &d->pos);
+    MPI_Type_commit(&d->pos);
+    MPI_Type_contiguous(sizeof(struct body), MPI_BYTE, &d->rec);
+    MPI_Type_commit(&d->rec);
+    MPI_Type_contiguous(sizeof(struct encke), MPI_BYTE, &d->erec);
+    MPI_Type_commit(&d->erec);
+    d->counts  = malloc(sizeof(int) * d->size);
+    d->displs  = malloc(sizeof(int) * d->size);
+    d->scounts = malloc(sizeof(int) * d->size);
+    d->sdispls = malloc(sizeof(int) * d->size);
+    if(!d->counts || !d->displs || !d->scounts || !d->sdispls) {
+        return 1;
+    }
+    for(r = 0; r < d->size; r++) {
+        lo = (uint64_t)dest->bcount * r / d->size;
+        hi = (uint64_t)dest->bcount * (r + 1) / d->size;
+        d->counts[r] = hi - lo;
+        d->displs[r] = lo;
+        if(r == d->rank) {
+            dest->lo = lo;
+            dest->hi = hi;
+        }
+    }
+    if(d->size < 2) {
+        return 0;
+    }
+
+    mark = calloc(dest->bcount, 1);
+    if(!mark) {
+        return 1;
+    }
+    d->scount = sim_dist_shared(dest, mark);
+    own = dest->hi - dest->lo;
+    nb        = malloc(sizeof(struct body) * (own + d->scount));
+    d->shared = malloc(sizeof(uint32_t) * (d->scount + 1));
+    d->srecv  = malloc(sizeof(struct body) * (d->scount + 1));
+    //the exchange has its own buffers, bodies stay usable while it is in flight
+    d->send   = malloc(sizeof(double) * DIM * (own + 1));
+    d->recv   = malloc(sizeof(double) * DIM * dest->bcount);
+    if(!nb || !d->shared || !d->srecv || !d->send || !d->recv) {
+        free(mark);
+        return 1;
+    }
+    memcpy(nb, dest->bodies + dest->lo, sizeof(struct body) * own);
+    for(u = 0; u < (uint32_t)dest->bcount; u++) {
+        dest->loc[u] = (u >= dest->lo && u < dest->hi) ? u - dest->lo : NOLOC;
+    }
+    for(u = 0, j = 0; u < (uint32_t)dest->bcount; u++) {
+        if(!mark[u]) continue;
+        d->shared[j] = u;
+        nb[own + j] = dest->bodies[u];
+        if(dest->loc[u] == NOLOC) {
+            dest->loc[u] = own + j;
+        }
+        j++;
+    }
+    free(mark);
+    free(dest->bodies);
+    dest->bodies = nb;
+    dest->nloc = own + d->scount;
+    printf("distributed: %d processes, about %u bodies each, %d shared\n",
+        d->size, own, d->scount);
     return 0;
 }
 
+/*---------------------------------------------------------------------------*/
+//end of step: owners send the records of shared bodies to all processes,
+//then held bodies can go back to absolute coordinates
+int sim_dist_share(struct state *s) {
+    struct dist *d = &s->dist;
+    int j,r,n;
+    uint32_t u;
+
+    if(d->scount) {
+        for(r = 0; r < d->size; r++) {
+            d->scounts[r] = 0;
+        }
+        for(j = 0; j < d->scount; j++) {
+            d->scounts[sim_dist_owner(s, s->idx[d->shared[j]])] += 1;
+        }
+        n = 0;
+        for(r = 0; r < d->size; r++) {
+            d->sdispls[r] = n;
+            n += d->scounts[r];
+        }
+        //own shared bodies go in place, at the displacement of this process
+        n = d->sdispls[d->rank];
+        for(j = 0; j < d->scount; j++) {
+            u = s->idx[d->shared[j]];
+            if(u >= s->lo && u < s->hi) {
+                d->srecv[n++] = *sim_at(s, u);
+            }
+        }
+        MPI_Allgatherv(MPI_IN_PLACE, 0, d->rec, d->srecv, d->scounts, d->sdispls,
+            d->rec, MPI_COMM_WORLD);
+        for(j = 0; j < d->scount; j++) {
+            u = s->idx[d->srecv[j].id];
+            if(u < s->lo || u >= s->hi) {
+                *sim_at(s, u) = d->srecv[j];
+            }
+        }
+    }
+    sim_fixup(s);
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+//move own body and encke records to the processes owning their new index,
+//k[i].i being the previous index of the body now at i. Shared copies are
+//found by id and do not move.
+int sim_dist_migrate(struct state *s, const struct mkey *k) {
+    struct dist *d = &s->dist;
+    struct body *sb,*rb;
+    struct encke *se,*re;
+    int *sc,*sd,*rc,*rd,*pos;
+    int r,j,own;
+    uint32_t i,o;
+
+    own = s->hi - s->lo;
+    sc  = calloc(d->size, sizeof(int));
+    sd  = malloc(sizeof(int) * d->size);
+    rc  = calloc(d->size, sizeof(int));
+    rd  = malloc(sizeof(int) * d->size);
+    pos = malloc(sizeof(int) * d->size);
+    sb  = malloc(sizeof(struct body) * (own + 1));
+    rb  = malloc(sizeof(struct body) * (own + 1));
+    se  = s->encke ? malloc(sizeof(struct encke) * (own + 1)) : NULL;
+    re  = s->encke ? malloc(sizeof(struct encke) * (own + 1)) : NULL;
+    if(!sc || !sd || !rc || !rd || !pos || !sb || !rb || (s->encke && (!se || !re))) {
+        printf("reorder: out of memory\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    //both sides walk the new indices in order, so records need no tag
+    for(i = 0; i < (uint32_t)s->bcount; i++) {
+        o = k[i].i;
+        if(o >= s->lo && o < s->hi) {
+            sc[sim_dist_owner(s, i)] += 1;
+        }
+    }
+    for(i = s->lo; i < s->hi; i++) {
+        rc[sim_dist_owner(s, k[i].i)] += 1;
+    }
+    sd[0] = rd[0] = 0;
+    for(r = 1; r < d->size; r++) {
+        sd[r] = sd[r-1] + sc[r-1];
+        rd[r] = rd[r-1] + rc[r-1];
+    }
+    memcpy(pos, sd, sizeof(int) * d->size);
+    for(i = 0; i < (uint32_t)s->bcount; i++) {
+        o = k[i].i;
+        if(o < s->lo || o >= s->hi) continue;
+        j = pos[sim_dist_owner(s, i)]++;
+        sb[j] = s->bodies[o - s->lo];
+        if(se) {
+            se[j] = s->encke[o - s->lo];
+        }
+    }
+    MPI_Alltoallv(sb, sc, sd, d->rec, rb, rc, rd, d->rec, MPI_COMM_WORLD);
+    if(se) {
+        MPI_Alltoallv(se, sc, sd, d->erec, re, rc, rd, d->erec, MPI_COMM_WORLD);
+    }
+    memcpy(pos, rd, sizeof(int) * d->size);
+    for(i = s->lo; i < s->hi; i++) {
+        j = pos[sim_dist_owner(s, k[i].i)]++;
+        s->bodies[i - s->lo] = rb[j];
+        if(re) {
+            s->encke[i - s->lo] = re[j];
+        }
+    }
+
+    for(i = 0; i < (uint32_t)s->bcount; i++) {
+        s->loc[i] = (i >= s->lo && i < s->hi) ? i - s->lo : NOLOC;
+    }
+    for(j = 0; j < d->scount; j++) {
+        i = s->idx[d->shared[j]];
+        if(s->loc[i] == NOLOC) {
+            s->loc[i] = own + j;
+        }
+    }
+    free(sc);
+    free(sd);
+    free(rc);
+    free(rd);
+    free(pos);
+    free(sb);
+    free(rb);
+    free(se);
+    free(re);
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+//sum the conserved quantities sampled by each process
+void sim_dist_diag(struct state *s) {
+    struct diag *dg = &s->diag;
+    double v[12];
+    int n = 0;
+
+    if(s->dist.size < 2) {
+        return;
+    }
+    v[n++] = dg->m;  v[n++] = dg->ke; v[n++] = dg->pe; v[n++] = dg->px;
+    v[n++] = dg->py; v[n++] = dg->lz; v[n++] = dg->cx; v[n++] = dg->cy;
+#if DIM == 3
+    v[n++] = dg->pz; v[n++] = dg->lx; v[n++] = dg->ly; v[n++] = dg->cz;
+#endif
+    MPI_Allreduce(MPI_IN_PLACE, v, n, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    n = 0;
+    dg->m  = v[n++]; dg->ke = v[n++]; dg->pe = v[n++]; dg->px = v[n++];
+    dg->py = v[n++]; dg->lz = v[n++]; dg->cx = v[n++]; dg->cy = v[n++];
+#if DIM == 3
+    dg->pz = v[n++]; dg->lx = v[n++]; dg->ly = v[n++]; dg->cz = v[n++];
+#endif
+}
+#endif
+
 /*---------------------------------------------------------------------------*/
 int sim_start(struct state *dest) {
     int p;
     dest->t = 0;
     dest->steps = 0;
+    dest->h = dest->dt;
+    dest->active = malloc(sizeof(int) * (dest->brcount + 1));
+    dest->idx = malloc(sizeof(uint32_t) * dest->bcount);
+    dest->loc = malloc(sizeof(uint32_t) * dest->bcount);
+    if(!dest->idx || !dest->loc || sim_kernel_alloc(&dest->kern, dest->bcount)) {
+        printf("start: out of memory\n");
+        return 1;
+    }
+    for(p=0;p<dest->bcount;p++) {
+        dest->idx[p] = p;
+        dest->loc[p] = p;
+    }
+    dest->nloc = dest->bcount;
+    sim_kernel_init(dest);
+    dest->lo = 0;
+    dest->hi = dest->bcount;
+#ifdef USE_MPI
+    if(sim_dist_start(dest)) {
+        printf("start: out of memory\n");
+        return 1;
+    }
+#endif
+    if(dest->rectify > 0) {
+        dest->encke = calloc(dest->hi - dest->lo + 1, sizeof(struct encke));
+    }
     for(p=0;p<dest->pcount;p++) {
+#ifdef USE_MPI
+        //plot samples are written by the first process only
+        if(dest->dist.rank) continue;
+#endif
         dest->plots[p].f = fopen(dest->plots[p].name,"wb");
         if(!dest->plots[p].f) {
             printf("failed to open plot%s\n", dest->plots[p].name);
+        } else if(plot_is_archive(dest->plots[p].name)) {
+            dest->plots[p].arc = arc_open(dest->plots[p].f, plot_columns(dest->plots[p].plots));
         }
     }
 
@@ -104,6 +1126,10 @@ int sim_body_add(struct state *dest, char *name, double mass, double radius) {
     dest->bodies = realloc(dest->bodies, sizeof(struct body) * (dest->bcount+1));
     if(dest->bodies) {
         memset(&dest->bodies[dest->bcount], 0, sizeof(struct body));
+        dest->bodies[dest->bcount].prim = -1;
+        dest->bodies[dest->bcount].atmo = -1;
+        dest->bodies[dest->bcount].around = -1;
+        dest->bodies[dest->bcount].id = dest->bcount;
         dest->bodies[dest->bcount].mass = mass;
         dest->bodies[dest->bcount].radius = radius;
         strncpy(dest->bodies[dest->bcount].name, name, NAMELEN);
@@ -130,8 +1156,8 @@ int sim_plot_add(struct state *dest, char *file, struct body *sat, struct body *
     dest->plots = realloc(dest->plots, sizeof(struct plot) * (dest->pcount+1));
     if(dest->plots) {
         memset(&dest->plots[dest->pcount], 0, sizeof(struct plot));
-        dest->plots[dest->pcount].sat   = sat;
-        dest->plots[dest->pcount].ref   = ref;
+        dest->plots[dest->pcount].sat   = sat->id;
+        dest->plots[dest->pcount].ref   = ref->id;
         dest->plots[dest->pcount].plots = plots;
         dest->plots[dest->pcount].nth   = nth;
         strncpy(dest->plots[dest->pcount].name, file, 256);
@@ -143,69 +1169,1141 @@ int sim_plot_add(struct state *dest, char *file, struct body *sat, struct body *
 }
 
 /*---------------------------------------------------------------------------*/
-int sim_run(struct state *s) {
-    uint32_t u,v;       //body indices
-    double dx,dy,d2,d;  //distance stuff
-    double f;           //force stuff
-    //local vars for speedup related to cache proximity
-    double ax,ay;       //accelerations
-    double rux,ruy;     //central body position
-    double um;          //central body mass
+//attach an empty density table to a planet, filled by the caller
+struct atmo *sim_atmo_add(struct state *dest, struct body *planet, double top, double step) {
+    struct atmo *a;
+    dest->atmos = realloc(dest->atmos, sizeof(struct atmo) * (dest->acount+1));
+    if(!dest->atmos) {
+        return NULL;
+    }
+    a = &dest->atmos[dest->acount];
+    a->n    = (int)ceil(top / step);
+    a->inv  = 1.0 / step;
+    a->top  = a->n * step;
+    a->lrho = malloc(sizeof(double) * (a->n + 3));
+    if(!a->lrho) {
+        return NULL;
+    }
+    a->lrho[a->n + 1] = ATMO_VACUUM;
+    a->lrho[a->n + 2] = ATMO_VACUUM;
+    a->body = planet->id;
+    planet->atmo = dest->acount;
+    dest->acount += 1;
+    printf("sim: add atmosphere to %s top %g step %g\n",planet->name,a->top,step);
+    return a;
+}
 
-    //memory locality speedups:
-    //load central body characteristics only once and not in inner iteration
+/*---------------------------------------------------------------------------*/
+//density at altitude, clamped to ground level below 0 and fading to vacuum
+//over the interval above the top
+static inline double atmo_density(const struct atmo *a, double alt) {
+    double x;
+    int i;
+    x = fmin(fmax(alt * a->inv, 0), a->n + 1);
+    i = (int)x;
+    x -= i;
+    return exp(a->lrho[i] + x * (a->lrho[i+1] - a->lrho[i]));
+}
 
-    //compute forces on each body
-    for(u = 0; u < s->bcount; u++) {
-        um = s->bodies[u].mass;
-        rux = s->bodies[u].rx;
-        ruy = s->bodies[u].ry;
-        ax = 0;
-        ay = 0;
-        for(v = 0; v < s->bcount; v++) {
-            if(v==u) continue;
-            dx = s->bodies[v].rx - rux;
-            dy = s->bodies[v].ry - ruy;
-            d2 = dx*dx + dy*dy;
-            d = sqrt(d2);
-            f  = G * um * s->bodies[v].mass / d2;
-            //direction from v to u (normalized vector)
-            dx = dx / d;
-            dy = dy / d;
-            //accumulate acceleration from v to u
-            ax += dx * f / um;
-            ay += dy * f / um;
+/*---------------------------------------------------------------------------*/
+//add drag of the dominant attractor atmosphere to ship accelerations.
+//the atmosphere does not rotate with its planet.
+void sim_drag(struct state *s) {
+    uint32_t u;
+    int i;
+    struct body *b,*p;
+    double rx,ry,vx,vy,d,v,k;
+    Z(double rz,vz;)
+
+    //only ships with a ballistic coefficient, against the few planets
+    //having an atmosphere: no attractor search over all bodies
+    for(u = s->lo; u < s->hi; u++) {
+        b = &s->bodies[u - s->lo];
+        if(b->bc <= 0) continue;
+        for(i = 0; i < s->acount; i++) {
+            p = sim_body(s, s->atmos[i].body);
+            if(p->atmo != i) continue; //replaced by a later definition
+            rx = b->rx - p->rx;
+            ry = b->ry - p->ry;
+            Z(rz = b->rz - p->rz;)
+            d = sqrt(rx*rx + ry*ry Z(+ rz*rz)) - p->radius;
+            if(d >= s->atmos[i].top) continue;
+            vx = b->vx - p->vx;
+            vy = b->vy - p->vy;
+            Z(vz = b->vz - p->vz;)
+            v = sqrt(vx*vx + vy*vy Z(+ vz*vz));
+            k = -0.5 * atmo_density(&s->atmos[i], d) * v / b->bc;
+            b->ax += k * vx;
+            b->ay += k * vy;
+            Z(b->az += k * vz;)
         }
-        //store central body acceleration only once
-        s->bodies[u].ax = ax;
-        s->bodies[u].ay = ay;
     }
+}
 
-    //integrate
-    for(u = 0; u < s->bcount; u++) {
-        s->bodies[u].vx += s->bodies[u].ax * s->dt;
-        s->bodies[u].vy += s->bodies[u].ay * s->dt;
-        s->bodies[u].rx += s->bodies[u].vx * s->dt;
-        s->bodies[u].ry += s->bodies[u].vy * s->dt;
+/*---------------------------------------------------------------------------*/
+int queue_push(struct queue *q, double t, int burn, int type) {
+    struct event e;
+    int i,up;
+    if(q->count == q->size) {
+        q->size = q->size ? q->size * 2 : 16;
+        q->ev = realloc(q->ev, sizeof(struct event) * q->size);
+        if(!q->ev) {
+            return 1;
+        }
     }
+    e.t = t;
+    e.burn = burn;
+    e.type = type;
+    //sift up
+    i = q->count++;
+    while(i > 0) {
+        up = (i - 1) / 2;
+        if(q->ev[up].t <= t) break;
+        q->ev[i] = q->ev[up];
+        i = up;
+    }
+    q->ev[i] = e;
+    return 0;
+}
 
-    //detect collisions
-    for(u = 0; u < s->bcount; u++) {
+/*---------------------------------------------------------------------------*/
+void queue_pop(struct queue *q, struct event *dest) {
+    struct event last;
+    int i,c;
+    *dest = q->ev[0];
+    last = q->ev[--q->count];
+    //sift down
+    i = 0;
+    while((c = 2*i + 1) < q->count) {
+        if(c + 1 < q->count && q->ev[c+1].t < q->ev[c].t) c += 1;
+        if(last.t <= q->ev[c].t) break;
+        q->ev[i] = q->ev[c];
+        i = c;
+    }
+    q->ev[i] = last;
+}
+
+/*---------------------------------------------------------------------------*/
+int sim_burn_add(struct state *dest, int ship, double start, double duration, double dv, int frame) {
+    struct burn *b;
+    dest->burns = realloc(dest->burns, sizeof(struct burn) * (dest->brcount+1));
+    if(!dest->burns) {
+        return 1;
+    }
+    b = &dest->burns[dest->brcount];
+    b->ship = ship;
+    b->ref = dest->bodies[ship].around; //parse time, ids are still indices
+    b->start = start;
+    b->duration = duration;
+    b->dv = dv;
+    b->frame = frame;
+    if(queue_push(&dest->events, start, dest->brcount, EVENT_START)) {
+        return 1;
+    }
+    if(duration > 0 && queue_push(&dest->events, start + duration, dest->brcount, EVENT_END)) {
+        return 1;
+    }
+    dest->brcount += 1;
+    printf("sim: add burn %s t %g dur %g dv %g frame %d\n",
+        dest->bodies[ship].name, start, duration, dv, frame);
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+//unit vector of a burn frame, relative to the ship reference body
+static void burn_dir(struct state *s, struct burn *br, double *dx, double *dy Z(, double *dz)) {
+    struct body *b = sim_body(s, br->ship);
+    struct body *p = sim_body(s, br->ref);
+    double x,y,n;
+    Z(double z;)
+    if(br->frame == FRAME_PROGRADE || br->frame == FRAME_RETROGRADE) {
+        x = b->vx - p->vx;
+        y = b->vy - p->vy;
+        Z(z = b->vz - p->vz;)
+    } else {
+        x = b->rx - p->rx;
+        y = b->ry - p->ry;
+        Z(z = b->rz - p->rz;)
+    }
+    n = sqrt(x*x + y*y Z(+ z*z));
+    if(br->frame == FRAME_RETROGRADE || br->frame == FRAME_ANTIRADIAL) {
+        n = -n;
+    }
+    *dx = x / n;
+    *dy = y / n;
+    Z(*dz = z / n;)
+}
+
+/*---------------------------------------------------------------------------*/
+//process due events and clip the next step so it ends on the next event.
+//only the queue head is looked at, whatever the number of planned burns.
+void sim_events(struct state *s) {
+    struct event e;
+    struct burn *br;
+    double dx,dy;
+    Z(double dz;)
+    int i;
+
+    while(s->events.count && s->events.ev[0].t <= s->t) {
+        queue_pop(&s->events, &e);
+        br = &s->burns[e.burn];
+        if(e.type == EVENT_END) {
+            for(i = 0; i < s->actcount; i++) {
+                if(s->active[i] == e.burn) {
+                    s->active[i] = s->active[--s->actcount];
+                    break;
+                }
+            }
+        } else if(br->duration > 0) {
+            s->active[s->actcount++] = e.burn;
+        } else {
+            //impulsive
+            burn_dir(s, br, &dx, &dy Z(, &dz));
+            sim_body(s, br->ship)->vx += br->dv * dx;
+            sim_body(s, br->ship)->vy += br->dv * dy;
+            Z(sim_body(s, br->ship)->vz += br->dv * dz;)
+            //encke ship: the kicked state becomes its new reference
+            i = s->idx[br->ship];
+            if(s->encke && i >= (int)s->lo && i < (int)s->hi) {
+                s->encke[i - s->lo].init = 0;
+            }
+        }
+        if(!s->clone) {
+            printf("burn %s %s at %g\n", sim_body(s, br->ship)->name,
+                e.type == EVENT_END ? "end" : "start", s->t);
+        }
+    }
+
+    s->h = s->dt;
+    s->tclip = s->tmax;
+    if(s->events.count && s->events.ev[0].t < s->tmax) {
+        s->tclip = s->events.ev[0].t;
+    }
+    if(s->tclip < s->t + s->dt) {
+        s->h = s->tclip - s->t;
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+//bring the active burns list to what it is at t, without applying
+//anything: the state at t already contains past impulses
+void sim_events_seek(struct state *s, double t) {
+    struct event e;
+    int i;
+    s->actcount = 0;
+    while(s->events.count && s->events.ev[0].t < t) {
+        queue_pop(&s->events, &e);
+        if(e.type == EVENT_END) {
+            for(i = 0; i < s->actcount; i++) {
+                if(s->active[i] == e.burn) {
+                    s->active[i] = s->active[--s->actcount];
+                    break;
+                }
+            }
+        } else if(s->burns[e.burn].duration > 0) {
+            s->active[s->actcount++] = e.burn;
+        }
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+//add finite burns thrust to ship accelerations
+void sim_thrust(struct state *s) {
+    struct burn *br;
+    double dx,dy,a;
+    Z(double dz;)
+    int i;
+
+    for(i = 0; i < s->actcount; i++) {
+        br = &s->burns[s->active[i]];
+        burn_dir(s, br, &dx, &dy Z(, &dz));
+        a = br->dv / br->duration;
+        sim_body(s, br->ship)->ax += a * dx;
+        sim_body(s, br->ship)->ay += a * dy;
+        Z(sim_body(s, br->ship)->az += a * dz;)
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+void sim_diag_reset(struct diag *dg) {
+    dg->m  = 0;
+    dg->ke = 0;
+    dg->pe = 0;
+    dg->px = 0;
+    dg->py = 0;
+    dg->lz = 0;
+    dg->cx = 0;
+    dg->cy = 0;
+#if DIM == 3
+    dg->pz = 0;
+    dg->lx = 0;
+    dg->ly = 0;
+    dg->cz = 0;
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+//accumulate one body; pe is the potential seen by this body, each pair is
+//seen twice so only half of it is accounted here
+void sim_diag_body(struct diag *dg, struct body *b, double pe) {
+    dg->m  += b->mass;
+    dg->ke += 0.5 * b->mass * (b->vx*b->vx + b->vy*b->vy Z(+ b->vz*b->vz));
+    dg->pe += 0.5 * pe;
+    dg->px += b->mass * b->vx;
+    dg->py += b->mass * b->vy;
+    dg->lz += b->mass * (b->rx * b->vy - b->ry * b->vx);
+    dg->cx += b->mass * b->rx;
+    dg->cy += b->mass * b->ry;
+#if DIM == 3
+    dg->pz += b->mass * b->vz;
+    dg->lx += b->mass * (b->ry * b->vz - b->rz * b->vy);
+    dg->ly += b->mass * (b->rz * b->vx - b->rx * b->vz);
+    dg->cz += b->mass * b->rz;
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+//relative drift, falls back to absolute drift when the reference is zero
+static double sim_diag_drift(double val, double ref) {
+    if(ref == 0) {
+        return fabs(val);
+    }
+    return fabs((val - ref) / ref);
+}
+
+/*---------------------------------------------------------------------------*/
+int sim_diag_report(struct state *s) {
+    struct diag *dg = &s->diag;
+    double e,l,de,dl;
+
+    e = dg->ke + dg->pe;
+#if DIM == 3
+    l = sqrt(dg->lx*dg->lx + dg->ly*dg->ly + dg->lz*dg->lz);
+#else
+    l = dg->lz;
+#endif
+    if(!dg->samples) {
+        dg->e0 = e;
+        dg->l0 = l;
+    }
+    dg->samples += 1;
+    de = sim_diag_drift(e, dg->e0);
+    dl = sim_diag_drift(l, dg->l0);
+    if(de > dg->de) dg->de = de;
+    if(dl > dg->dl) dg->dl = dl;
+
+#if DIM == 3
+    printf("diag: t %g E %.10g dE %g L %.10g dL %g P %g %g %g CM %g %g %g\n",
+        s->t, e, de, l, dl, dg->px, dg->py, dg->pz,
+        dg->cx / dg->m, dg->cy / dg->m, dg->cz / dg->m);
+#else
+    printf("diag: t %g E %.10g dE %g L %.10g dL %g P %g %g CM %g %g\n",
+        s->t, e, de, l, dl, dg->px, dg->py, dg->cx / dg->m, dg->cy / dg->m);
+#endif
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+int sim_diag_summary(struct state *s) {
+    struct diag *dg = &s->diag;
+    if(!dg->samples) {
+        return 0;
+    }
+    printf("diag: %lu samples, max energy drift %g, max angular momentum drift %g\n",
+        dg->samples, dg->de, dg->dl);
+    return 0;
+}
+
+#if DIM == 2
+/*---------------------------------------------------------------------------*/
+/**
+ * Levi-Civita propagation of a keplerian relative state over dt.
+ * With x = u^2 (complex plane) and dt = r.ds, the motion around a point mass
+ * becomes u'' = (h/2).u, an harmonic oscillator without singularity at r=0.
+ * It is solved exactly, then ds is found by newton iteration on t(s) = dt.
+ * @param mu gravitational parameter of the attractor
+ * @param x,y,vx,vy relative state, updated in place
+ * @param dt time to propagate
+ */
+static void lc_kepler(double mu, double *x, double *y, double *vx, double *vy, double dt) {
+    double complex u0,up0,u,up,z;
+    double r0,h,beta,w,a,b,c,cs,sn,i2,t,r,sd,ds;
+    int it;
+
+    z  = *x + I * *y;
+    r0 = cabs(z);
+    u0 = csqrt(z);
+    up0 = 0.5 * (*vx + I * *vy) * conj(u0);
+    h = 0.5 * (*vx * *vx + *vy * *vy) - mu / r0;
+    beta = -0.5 * h;
+
+    //|u(s)|^2 = a.cs^2 + b.sn^2 + 2c.cs.sn
+    a = r0;
+    b = creal(up0 * conj(up0));
+    c = creal(u0 * conj(up0));
+
+    sd = dt / r0;
+    for(it = 0; it < 50; it++) {
+        if(beta > 0) {
+            w  = sqrt(beta);
+            cs = cos(w * sd);
+            sn = sin(w * sd) / w;
+        } else if(beta < 0) {
+            w  = sqrt(-beta);
+            cs = cosh(w * sd);
+            sn = sinh(w * sd) / w;
+        } else {
+            cs = 1;
+            sn = sd;
+        }
+        //integral of sn^2, series when the closed form cancels out
+        if(fabs(beta) * sd * sd < 1e-4) {
+            i2 = sd * sd * sd * (1.0/3 - beta * sd * sd / 15 + 2 * beta * beta * sd * sd * sd * sd / 315);
+        } else {
+            i2 = (sd - cs * sn) / (2 * beta);
+        }
+        t = 0.5 * a * (sd + cs * sn) + b * i2 + c * sn * sn;
+        r = a * cs * cs + b * sn * sn + 2 * c * cs * sn;
+        ds = (t - dt) / r;
+        sd -= ds;
+        if(sd < 0) sd = 0.5 * (sd + ds);
+        if(fabs(ds) <= 1e-15 * fabs(sd)) break;
+    }
+
+    u  = u0 * cs + up0 * sn;
+    up = up0 * cs - beta * u0 * sn;
+    z  = u * u;
+    r  = creal(u * conj(u));
+    *x = creal(z);
+    *y = cimag(z);
+    z  = 2 * u * up / r;
+    *vx = creal(z);
+    *vy = cimag(z);
+}
+
+/*---------------------------------------------------------------------------*/
+//propagate a ship close to its attractor with Levi-Civita regularization.
+//the keplerian part is exact, other bodies and the attractor own motion are
+//applied as a kick. The ship state is left relative to the attractor and
+//flagged BODY_REL until the attractor itself has been integrated.
+//The attractor must not be a ship: a close pair of massive bodies would need
+//a two-body (centre of mass + relative) transform, it keeps the plain step.
+//Moons are declared as planets with a position and velocity for that reason.
+int sim_reg_step(struct state *s, uint32_t u) {
+    struct body *b = sim_at(s, u);
+    struct body *p;
+    double rx,ry,vx,vy,d,mu,hz,e,q;
+
+    if(!(b->flags & BODY_SHIP) || b->prim < 0 || (b->flags & BODY_REL)) return 0;
+    if(s->loc[b->prim] == NOLOC) return 0; //a ship of another process
+    p = sim_at(s, b->prim);
+    if(p->flags & BODY_SHIP) return 0; //attractor must not move as a regularized body
+
+    rx = b->rx - p->rx;
+    ry = b->ry - p->ry;
+    vx = b->vx - p->vx;
+    vy = b->vy - p->vy;
+    d = sqrt(rx*rx + ry*ry);
+    //decided on the osculating orbit rather than the current distance, so an
+    //eccentric orbit stays regularized on its far arc: periapsis q closer
+    //than reg steps of the periapsis speed hz/q
+    mu = G * p->mass;
+    hz = rx * vy - ry * vx;
+    e = sqrt(fmax(0, 1 + (vx*vx + vy*vy - 2 * mu / d) * hz * hz / (mu * mu)));
+    q = hz * hz / (mu * (1 + e));
+    if(q * q >= s->reg * fabs(hz) * s->h) return 0;
+
+    //perturbations: everything but the attractor pull, minus attractor accel
+    vx += (b->ax - b->kx - p->ax) * s->h;
+    vy += (b->ay - b->ky - p->ay) * s->h;
+    lc_kepler(mu, &rx, &ry, &vx, &vy, s->h);
+
+    b->rx = rx;
+    b->ry = ry;
+    b->vx = vx;
+    b->vy = vy;
+    b->rel = b->prim;
+    b->flags |= BODY_REL;
+    return 1;
+}
+#endif
+
+/*---------------------------------------------------------------------------*/
+//spread the low bits of v so that DIM coordinates can be interleaved
+static inline uint64_t morton_spread(uint64_t v) {
+#if DIM == 3
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x001f00000000ffffULL;
+    v = (v | v << 16) & 0x001f0000ff0000ffULL;
+    v = (v | v << 8)  & 0x100f00f00f00f00fULL;
+    v = (v | v << 4)  & 0x10c30c30c30c30c3ULL;
+    v = (v | v << 2)  & 0x1249249249249249ULL;
+#else
+    v &= 0xffffffff;
+    v = (v | v << 16) & 0x0000ffff0000ffffULL;
+    v = (v | v << 8)  & 0x00ff00ff00ff00ffULL;
+    v = (v | v << 4)  & 0x0f0f0f0f0f0f0f0fULL;
+    v = (v | v << 2)  & 0x3333333333333333ULL;
+    v = (v | v << 1)  & 0x5555555555555555ULL;
+#endif
+    return v;
+}
+
+/*---------------------------------------------------------------------------*/
+static int mkey_cmp(const void *a, const void *b) {
+    const struct mkey *ka = a;
+    const struct mkey *kb = b;
+    if(ka->key != kb->key) return ka->key < kb->key ? -1 : 1;
+    return ka->i < kb->i ? -1 : ka->i > kb->i;
+}
+
+/*---------------------------------------------------------------------------*/
+//sort bodies along a Morton curve so that bodies close in space are close
+//in memory. Everything kept across steps refers to bodies by id. Keys come
+//from the kernel, all processes find the same order and move their records.
+int sim_reorder(struct state *s) {
+    struct kernel *kn = &s->kern;
+    struct mkey *k;
+    struct body *nb;
+    struct encke *ne;
+    uint32_t *id;
+    double *t;
+    real *tg;
+    double lo[3],hi[3],sc[3];
+    const double qmax = (DIM == 3) ? 2097151.0 : 4294967295.0;
+    int i,j,dist;
+
+    //distributed records are moved by sim_dist_migrate
+    dist = 0;
+#ifdef USE_MPI
+    dist = s->dist.size > 1;
+#endif
+    k  = malloc(sizeof(struct mkey) * s->bcount);
+    id = malloc(sizeof(uint32_t) * s->bcount);
+    t  = malloc(sizeof(double) * s->bcount);
+    tg = malloc(sizeof(real) * s->bcount);
+    nb = dist ? NULL : malloc(sizeof(struct body) * s->bcount);
+    ne = (dist || !s->encke) ? NULL : malloc(sizeof(struct encke) * s->bcount);
+    if(!k || !id || !t || !tg || (!dist && !nb) || (!dist && s->encke && !ne)) {
+        free(k);
+        free(id);
+        free(t);
+        free(tg);
+        free(nb);
+        free(ne);
+        return 1;
+    }
+
+    //bounding box
+    for(j = 0; j < DIM; j++) {
+        lo[j] = INFINITY;
+        hi[j] = -INFINITY;
+    }
+    for(i = 0; i < s->bcount; i++) {
+        lo[0] = fmin(lo[0], kn->x[i]);
+        hi[0] = fmax(hi[0], kn->x[i]);
+        lo[1] = fmin(lo[1], kn->y[i]);
+        hi[1] = fmax(hi[1], kn->y[i]);
+        Z(lo[2] = fmin(lo[2], kn->z[i]);)
+        Z(hi[2] = fmax(hi[2], kn->z[i]);)
+    }
+    for(j = 0; j < DIM; j++) {
+        sc[j] = hi[j] > lo[j] ? qmax / (hi[j] - lo[j]) : 0;
+    }
+
+    for(i = 0; i < s->bcount; i++) {
+        k[i].i = i;
+        k[i].key  = morton_spread((uint64_t)((kn->x[i] - lo[0]) * sc[0]));
+        k[i].key |= morton_spread((uint64_t)((kn->y[i] - lo[1]) * sc[1])) << 1;
+        Z(k[i].key |= morton_spread((uint64_t)((kn->z[i] - lo[2]) * sc[2])) << 2;)
+    }
+    qsort(k, s->bcount, sizeof(struct mkey), mkey_cmp);
+
+    //index -> id, then the new indices
+    for(i = 0; i < s->bcount; i++) {
+        id[s->idx[i]] = i;
+    }
+    for(i = 0; i < s->bcount; i++) {
+        s->idx[id[k[i].i]] = i;
+    }
+    for(i = 0; i < s->bcount; i++) t[i] = kn->x[k[i].i];
+    memcpy(kn->x, t, sizeof(double) * s->bcount);
+    for(i = 0; i < s->bcount; i++) t[i] = kn->y[k[i].i];
+    memcpy(kn->y, t, sizeof(double) * s->bcount);
+#if DIM == 3
+    for(i = 0; i < s->bcount; i++) t[i] = kn->z[k[i].i];
+    memcpy(kn->z, t, sizeof(double) * s->bcount);
+#endif
+    for(i = 0; i < s->bcount; i++) t[i] = kn->rad[k[i].i];
+    memcpy(kn->rad, t, sizeof(double) * s->bcount);
+    for(i = 0; i < s->bcount; i++) tg[i] = kn->gm[k[i].i];
+    memcpy(kn->gm, tg, sizeof(real) * s->bcount);
+
+#ifdef USE_MPI
+    if(dist) {
+        sim_dist_migrate(s, k);
+    }
+#endif
+    if(!dist) {
+        for(i = 0; i < s->bcount; i++) {
+            nb[i] = s->bodies[k[i].i];
+            if(ne) {
+                ne[i] = s->encke[k[i].i];
+            }
+        }
+        free(s->bodies);
+        s->bodies = nb;
+        if(ne) {
+            free(s->encke);
+            s->encke = ne;
+        }
+    }
+    free(k);
+    free(id);
+    free(t);
+    free(tg);
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+//memory locality speedups: flat arrays, refreshed with the positions of own
+//bodies [u0,u1), G.m is premultiplied in kernel precision once for all
+static void sim_kernel_load(struct state *s, uint32_t u0, uint32_t u1) {
+    struct kernel *k = &s->kern;
+    uint32_t u;
+    for(u = u0; u < u1; u++) {
+        k->x[u]  = s->bodies[u - s->lo].rx;
+        k->y[u]  = s->bodies[u - s->lo].ry;
+        Z(k->z[u] = s->bodies[u - s->lo].rz;)
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+//reset accelerations of bodies [u0,u1) before accumulating force blocks
+static void sim_forces_start(struct state *s, uint32_t u0, uint32_t u1) {
+    uint32_t u;
+    for(u = u0; u < u1; u++) {
+        struct body *b = sim_at(s, u);
+        b->ax = 0;
+        b->ay = 0;
+        Z(b->az = 0;)
+        s->kern.pe[u] = 0;
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+//pull of bodies [v0,v1) on the point (rux,ruy), added to acc = ax ay pe [az].
+//free of branches so that it vectorizes: the caller leaves the body itself
+//out, and the potential costs less to always sum than to test for.
+static void sim_forces_row(const struct kernel *k, uint32_t v0, uint32_t v1,
+    double rux, double ruy Z(, double ruz), double *acc) {
+    const double *x = k->x, *y = k->y;
+    Z(const double *z = k->z;)
+    const real *gm = k->gm;
+    size_t v;           //not uint32_t: a counter that may wrap defeats contiguous loads
+    real dx,dy,d2,id;   //distance stuff, id = 1/d
+    real f;             //acceleration stuff
+    //accumulators stay in double whatever the kernel precision
+    double ax,ay,pe;
+#if DIM == 3
+    real dz;
+    double az;
+#endif
+
+    ax = 0;
+    ay = 0;
+    pe = 0;
+    Z(az = 0;)
+#if DIM == 3
+#pragma omp simd reduction(+:ax,ay,az,pe)
+#else
+#pragma omp simd reduction(+:ax,ay,pe)
+#endif
+    for(v = v0; v < v1; v++) {
+        //difference in double, absolute positions do not fit a float
+        dx = x[v] - rux;
+        dy = y[v] - ruy;
+        Z(dz = z[v] - ruz;)
+        d2 = dx*dx + dy*dy Z(+ dz*dz);
+        //a single division, and no d^3 term: it overflows a float past ~47 AU
+        id = 1 / real_sqrt(d2);
+        f = gm[v] * id;
+        pe -= f;
+        f = f * id * id;
+        //accumulate acceleration from v, direction normalized by d
+        ax += dx * f;
+        ay += dy * f;
+        Z(az += dz * f;)
+    }
+    acc[0] += ax;
+    acc[1] += ay;
+    acc[2] += pe;
+    Z(acc[3] += az;)
+}
+
+/*---------------------------------------------------------------------------*/
+//accumulate accelerations of bodies [u0,u1) due to bodies [v0,v1)
+static void sim_forces_block(struct state *s, uint32_t u0, uint32_t u1,
+    uint32_t v0, uint32_t v1) {
+    struct kernel *k = &s->kern;
+    struct body *b;
+    uint32_t u,m0,m1;   //body index, the row is split around it
+    double acc[DIM+1];
+
+    for(u = u0; u < u1; u++) {
+        b = sim_at(s, u);
+        acc[0] = b->ax;
+        acc[1] = b->ay;
+        acc[2] = k->pe[u];
+        Z(acc[3] = b->az;)
+        m0 = u < v0 ? v0 : u > v1 ? v1 : u;
+        m1 = u + 1 < v0 ? v0 : u + 1 > v1 ? v1 : u + 1;
+        sim_forces_row(k, v0, m0, k->x[u], k->y[u] Z(, k->z[u]), acc);
+        sim_forces_row(k, m1, v1, k->x[u], k->y[u] Z(, k->z[u]), acc);
+        b->ax = acc[0];
+        b->ay = acc[1];
+        k->pe[u] = acc[2];
+        Z(b->az = acc[3];)
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+//dominant attractor of body u, kept out of the force rows to leave them
+//without branches. Needs the whole kernel loaded.
+static void sim_attractor(struct state *s, uint32_t u) {
+    struct kernel *k = &s->kern;
+    uint32_t v;
+    double dx,dy,f,fk;
+    Z(double dz;)
+
+    fk = 0;
+    sim_at(s, u)->prim = -1;
+    for(v = 0; v < (uint32_t)s->bcount; v++) {
+        if(v == u) continue;
+        dx = k->x[v] - k->x[u];
+        dy = k->y[v] - k->y[u];
+        Z(dz = k->z[v] - k->z[u];)
+        f = k->gm[v] / (dx*dx + dy*dy Z(+ dz*dz));
+        if(f > fk) {
+            fk = f;
+            sim_at(s, u)->prim = v;
+        }
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+//finish the force pass of bodies [u0,u1): dominant attractor pull and diag
+static void sim_forces_end(struct state *s, uint32_t u0, uint32_t u1, int dg) {
+    uint32_t u;
+    for(u = u0; u < u1; u++) {
+        struct body *b = sim_at(s, u);
+        //only regularization of ships looks at the attractor, which
+        //is held unless it is a ship of another process
+        if((b->flags & BODY_SHIP) && s->reg > 0) {
+            sim_attractor(s, u);
+        }
+        if(b->prim >= 0 && s->loc[b->prim] != NOLOC) {
+            struct body *p = sim_at(s, b->prim);
+            double px,py,pd;
+            Z(double pz;)
+            px = p->rx - b->rx;
+            py = p->ry - b->ry;
+            Z(pz = p->rz - b->rz;)
+            pd = sqrt(px*px + py*py Z(+ pz*pz));
+            pd = G * p->mass / (pd * pd * pd);
+            b->kx = px * pd;
+            b->ky = py * pd;
+            Z(b->kz = pz * pd;)
+        }
+        if(dg) {
+            sim_diag_body(&s->diag, b, s->kern.pe[u] * b->mass);
+        }
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+//Stumpff functions C(z) and S(z)
+static void stumpff(double z, double *c, double *s) {
+    double w;
+    if(z > 1e-6) {
+        w = sqrt(z);
+        *c = (1 - cos(w)) / z;
+        *s = (w - sin(w)) / (z * w);
+    } else if(z < -1e-6) {
+        w = sqrt(-z);
+        *c = (cosh(w) - 1) / -z;
+        *s = (sinh(w) - w) / (-z * w);
+    } else {
+        *c = 1.0/2 - z / 24 + z * z / 720;
+        *s = 1.0/6 - z / 120 + z * z / 5040;
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+/**
+ * Keplerian propagation with universal variables and f and g functions,
+ * valid for any conic and in both 2D and 3D.
+ * @param mu gravitational parameter of the central body
+ * @param r0,v0 state at epoch, relative to the central body
+ * @param dt time since epoch
+ * @param r,v propagated state
+ */
+static void kepler_fg(double mu, const double *r0, const double *v0, double dt, double *r, double *v) {
+    double smu,nr0,vr0,v02,alpha,x,z,c,s,fx,dfx,dx,f,g,fd,gd,nr;
+    int j,it;
+
+    smu = sqrt(mu);
+    nr0 = 0;
+    vr0 = 0;
+    v02 = 0;
+    for(j = 0; j < DIM; j++) {
+        nr0 += r0[j] * r0[j];
+        vr0 += r0[j] * v0[j];
+        v02 += v0[j] * v0[j];
+    }
+    nr0 = sqrt(nr0);
+    vr0 /= nr0;
+    alpha = 2 / nr0 - v02 / mu;
+
+    //newton on the universal anomaly
+    x = smu * fabs(alpha) * dt;
+    if(x == 0) {
+        x = smu * dt / nr0;
+    }
+    for(it = 0; it < 50; it++) {
+        z = alpha * x * x;
+        stumpff(z, &c, &s);
+        fx  = nr0 * vr0 / smu * x * x * c + (1 - alpha * nr0) * x * x * x * s + nr0 * x - smu * dt;
+        dfx = nr0 * vr0 / smu * x * (1 - z * s) + (1 - alpha * nr0) * x * x * c + nr0;
+        dx = fx / dfx;
+        x -= dx;
+        if(fabs(dx) <= 1e-14 * fabs(x)) break;
+    }
+    z = alpha * x * x;
+    stumpff(z, &c, &s);
+
+    f = 1 - x * x / nr0 * c;
+    g = dt - x * x * x * s / smu;
+    nr = 0;
+    for(j = 0; j < DIM; j++) {
+        r[j] = f * r0[j] + g * v0[j];
+        nr += r[j] * r[j];
+    }
+    nr = sqrt(nr);
+    fd = smu / (nr * nr0) * (z * s - 1) * x;
+    gd = 1 - x * x / nr * c;
+    for(j = 0; j < DIM; j++) {
+        v[j] = fd * r0[j] + gd * v0[j];
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+//Encke propagation of a ship around the body it was positioned around:
+//only the small deviation from an osculating reference conic is integrated,
+//the conic itself is exact. The reference is rectified to the current state
+//when the deviation grows too large. Leaves the state BODY_REL like reg.
+int sim_encke_step(struct state *s, uint32_t u) {
+    struct body *b = sim_at(s, u);
+    struct body *p;
+    struct encke *e;
+    double r0[3],v0[3],ref[3],refv[3],dr[3],dv[3],r[3],a[3];
+    double mu,nref,nr,nd,q,fq,k;
+    int j;
+
+    if(!(b->flags & BODY_SHIP) || b->around < 0) return 0;
+    p = sim_body(s, b->around);
+    if(p->flags & BODY_SHIP) return 0; //reference body must not move as an encke body
+    e = &s->encke[u - s->lo];
+    mu = G * p->mass;
+
+    if(!e->init) {
+        e->init = 1;
+        e->t0 = s->t;
+        e->rx = b->rx - p->rx;
+        e->ry = b->ry - p->ry;
+        e->vx = b->vx - p->vx;
+        e->vy = b->vy - p->vy;
+        e->dx = e->dy = e->dvx = e->dvy = 0;
+#if DIM == 3
+        e->rz = b->rz - p->rz;
+        e->vz = b->vz - p->vz;
+        e->dz = e->dvz = 0;
+#endif
+    }
+    r0[0] = e->rx;
+    r0[1] = e->ry;
+    v0[0] = e->vx;
+    v0[1] = e->vy;
+    dr[0] = e->dx;
+    dr[1] = e->dy;
+    dv[0] = e->dvx;
+    dv[1] = e->dvy;
+    Z(r0[2] = e->rz; v0[2] = e->vz; dr[2] = e->dz; dv[2] = e->dvz;)
+
+    //reference now, true relative position and central pull on it
+    kepler_fg(mu, r0, v0, s->t - e->t0, ref, refv);
+    nref = 0;
+    nr = 0;
+    q = 0;
+    for(j = 0; j < DIM; j++) {
+        r[j] = ref[j] + dr[j];
+        nref += ref[j] * ref[j];
+        nr += r[j] * r[j];
+        q += dr[j] * (dr[j] - 2 * r[j]);
+    }
+    nref = sqrt(nref);
+    q /= nr;
+    nr = sqrt(nr);
+
+    //perturbations: total accel minus central pull, minus reference body accel
+    a[0] = b->ax - p->ax + mu * r[0] / (nr * nr * nr);
+    a[1] = b->ay - p->ay + mu * r[1] / (nr * nr * nr);
+    Z(a[2] = b->az - p->az + mu * r[2] / (nr * nr * nr);)
+
+    //deviation acceleration, Battin form free of cancellation
+    fq = q * (3 + 3 * q + q * q) / (1 + pow(1 + q, 1.5));
+    k = mu / (nref * nref * nref);
+    for(j = 0; j < DIM; j++) {
+        a[j] -= k * (dr[j] + fq * r[j]);
+        dv[j] += a[j] * s->h;
+        dr[j] += dv[j] * s->h;
+    }
+
+    kepler_fg(mu, r0, v0, s->t + s->h - e->t0, ref, refv);
+    nref = 0;
+    nd = 0;
+    for(j = 0; j < DIM; j++) {
+        nref += ref[j] * ref[j];
+        nd += dr[j] * dr[j];
+    }
+    b->rx = ref[0] + dr[0];
+    b->ry = ref[1] + dr[1];
+    b->vx = refv[0] + dv[0];
+    b->vy = refv[1] + dv[1];
+    Z(b->rz = ref[2] + dr[2]; b->vz = refv[2] + dv[2];)
+
+    if(nd > s->rectify * s->rectify * nref) {
+        //rectify: current state becomes the new reference
+        e->init = 0;
+    } else {
+        e->dx = dr[0];
+        e->dy = dr[1];
+        e->dvx = dv[0];
+        e->dvy = dv[1];
+        Z(e->dz = dr[2]; e->dvz = dv[2];)
+    }
+    b->rel = s->idx[b->around];
+    b->flags |= BODY_REL;
+    return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+//acceleration row of body p at this step when another process owns it
+static void sim_ref_row(struct state *s, uint32_t p) {
+    if(p >= s->lo && p < s->hi) return;
+    sim_forces_start(s, p, p+1);
+    sim_forces_block(s, p, p+1, 0, s->bcount);
+}
+
+/*---------------------------------------------------------------------------*/
+//encke and regularized steps subtract the acceleration of their reference
+//body, which must be the one of this step and not the last exchanged one
+static void sim_ref_rows(struct state *s) {
+    uint32_t u;
+    struct body *b;
+    if(s->lo == 0 && s->hi == (uint32_t)s->bcount) return;
+    for(u = s->lo; u < s->hi; u++) {
+        b = sim_at(s, u);
+        if(!(b->flags & BODY_SHIP)) continue;
+        if(s->encke && b->around >= 0) {
+            sim_ref_row(s, s->idx[b->around]);
+        }
+#if DIM == 2
+        if(s->reg > 0 && b->prim >= 0 && s->loc[b->prim] != NOLOC &&
+           !(sim_at(s, b->prim)->flags & BODY_SHIP)) {
+            sim_ref_row(s, b->prim);
+        }
+#endif
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+//make the whole state current: back to absolute coordinates once reference
+//bodies have moved, then detect collisions. In distributed mode this first
+//completes the exchange of the positions of the other processes.
+int sim_sync(struct state *s) {
+    struct kernel *k = &s->kern;
+    uint32_t u,v;       //body indices
+    double dx,dy,d2,d;  //distance stuff
+    Z(double dz;)
+    int hit;
+
+    if(!s->stale) {
+        return 0;
+    }
+    s->stale = 0;
+#ifdef USE_MPI
+    if(s->dist.size > 1) {
+        const double *r = s->dist.recv;
+        MPI_Wait(&s->dist.req, MPI_STATUS_IGNORE);
+        for(u = 0; u < (uint32_t)s->bcount; u++) {
+            if(u >= s->lo && u < s->hi) continue;
+            k->x[u] = r[u*DIM];
+            k->y[u] = r[u*DIM + 1];
+            Z(k->z[u] = r[u*DIM + 2];)
+        }
+    }
+#endif
+    sim_fixup(s);
+    sim_kernel_load(s, s->lo, s->hi);
+
+    //detect collisions, each process checks the pairs of its own bodies
+    hit = 0;
+    for(u = s->lo; u < s->hi; u++) {
         for(v = u+1; v < s->bcount; v++) {
-            dx = s->bodies[v].rx - s->bodies[u].rx;
-            dy = s->bodies[v].ry - s->bodies[u].ry;
-            d2 = dx*dx + dy*dy;
+            dx = k->x[v] - k->x[u];
+            dy = k->y[v] - k->y[u];
+            Z(dz = k->z[v] - k->z[u];)
+            d2 = dx*dx + dy*dy Z(+ dz*dz);
             d = sqrt(d2);
-            if(d < (s->bodies[u].radius + s->bodies[v].radius)) {
-                printf("collision!\n");
-                s->t = s->tmax;
+            if(d < (k->rad[u] + k->rad[v])) {
+                hit = 1;
             }
         }
     }
+#ifdef USE_MPI
+    //parareal slices sync from their own threads, MPI is not initialized
+    //for that, and a single process has nothing to combine anyway
+    if(s->dist.size > 1 && !s->clone) {
+        MPI_Allreduce(MPI_IN_PLACE, &hit, 1, MPI_INT, MPI_LOR, MPI_COMM_WORLD);
+    }
+#endif
+    if(hit && !s->clone) {
+        printf("collision!\n");
+        s->t = s->tmax;
+    }
+    if(hit) {
+        s->hit = 1;
+    }
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+int sim_run(struct state *s) {
+    uint32_t u;         //body indices
+    int dg;             //conserved quantities sampled during this step
+
+    //conserved quantities are sampled in the force pass itself,
+    //the potential comes for free from the force row (G.m/d)
+    dg = s->diag.nth && !(s->steps % s->diag.nth);
+    if(dg) {
+        sim_diag_reset(&s->diag);
+    }
+    //attractor indices are recomputed by the force pass just after
+    if(s->reorder && !(s->steps % s->reorder)) {
+        sim_sync(s);
+        sim_reorder(s);
+    }
+
+    //own bodies interact with each other while the other positions are in
+    //flight, own bodies are absolute again once shared bodies were received
+    sim_forces_start(s, s->lo, s->hi);
+    sim_kernel_load(s, s->lo, s->hi);
+    sim_forces_block(s, s->lo, s->hi, s->lo, s->hi);
+    sim_sync(s);
+    if(s->lo > 0 || s->hi < (uint32_t)s->bcount) {
+        sim_forces_block(s, s->lo, s->hi, 0, s->lo);
+        sim_forces_block(s, s->lo, s->hi, s->hi, s->bcount);
+    }
+    sim_forces_end(s, s->lo, s->hi, dg);
+    if(dg) {
+#ifdef USE_MPI
+        sim_dist_diag(s);
+#endif
+        sim_diag_report(s);
+    }
+
+    //impulses only change velocities, they can come after the force pass
+    sim_events(s);
+    if(s->acount) {
+        sim_drag(s);
+    }
+    if(s->actcount) {
+        sim_thrust(s);
+    }
+
+    //encke and regularized ships: propagated relative to their reference body,
+    //this must see the reference state before it is integrated
+    sim_ref_rows(s);
+    if(s->encke) {
+        for(u = s->lo; u < s->hi; u++) {
+            sim_encke_step(s, u);
+        }
+    }
+#if DIM == 2
+    if(s->reg > 0) {
+        for(u = s->lo; u < s->hi; u++) {
+            sim_reg_step(s, u);
+        }
+    }
+#endif
+
+    //integrate
+    for(u = 0; u < s->hi - s->lo; u++) {
+        struct body *b = &s->bodies[u];
+        if(b->flags & BODY_REL) continue;
+        b->vx += b->ax * s->h;
+        b->vy += b->ay * s->h;
+        b->rx += b->vx * s->h;
+        b->ry += b->vy * s->h;
+#if DIM == 3
+        b->vz += b->az * s->h;
+        b->rz += b->vz * s->h;
+#endif
+    }
 
-    //do it
-    s->t += s->dt;
+    //do it before collisions may end the run, a clipped step lands exactly on its event
+    if(s->h < s->dt) {
+        s->t = s->tclip;
+    } else {
+        s->t += s->h;
+    }
     s->steps += 1;
+
+    s->stale = 1;
+#ifdef USE_MPI
+    if(s->dist.size > 1) {
+        //positions are completed by the next sim_sync, overlapped with the
+        //next force block. Shared records first: own bodies must be absolute.
+        sim_dist_share(s);
+        for(u = 0; u < s->hi - s->lo; u++) {
+            s->dist.send[u*DIM]     = s->bodies[u].rx;
+            s->dist.send[u*DIM + 1] = s->bodies[u].ry;
+            Z(s->dist.send[u*DIM + 2] = s->bodies[u].rz;)
+        }
+        MPI_Iallgatherv(s->dist.send, s->hi - s->lo, s->dist.pos, s->dist.recv,
+            s->dist.counts, s->dist.displs, s->dist.pos, MPI_COMM_WORLD, &s->dist.req);
+        return 0;
+    }
+#endif
+    sim_sync(s);
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+//parareal slices write archive rows raw, they are encoded once merged
+int plot_write(struct state *s, struct plot *pl, const double *row, int n) {
+    int i;
+    if(pl->arc) {
+        if(s->clone) {
+            return fwrite(row, sizeof(double), n, pl->f) != (size_t)n;
+        }
+        return arc_append(pl->arc, pl->f, row);
+    }
+    for(i = 0; i < n; i++) {
+        fprintf(pl->f, "%g ", row[i]);
+    }
+    fprintf(pl->f, "\n");
     return 0;
 }
 
@@ -213,162 +2311,868 @@ int sim_run(struct state *s) {
 int sim_plots(struct state *s) {
     int p;
     uint32_t pl;
+    struct body *sat,*ref;
     double drx,dry,dvx,dvy,dax,day,mu;
+    Z(double drz,dvz,daz;)
+    double row[PLOT_MAXCOL];
+    int n;
 
-
+    //samples need the bodies of all processes
+    for(p = 0; p<s->pcount; p++) {
+        if(!(s->steps % s->plots[p].nth)) {
+            sim_sync(s);
+            break;
+        }
+    }
     for(p = 0; p<s->pcount; p++) {
         if(s->steps % s->plots[p].nth) continue;
+        if(!s->plots[p].f) continue;
 
         //printf("[%lu] %g ", s->steps, s->t - s->dt);
-        fprintf(s->plots[p].f, "%g ", s->t);
-
-        drx = s->plots[p].sat->rx - s->plots[p].ref->rx;
-        dry = s->plots[p].sat->ry - s->plots[p].ref->ry;
-        dvx = s->plots[p].sat->vx - s->plots[p].ref->vx;
-        dvy = s->plots[p].sat->vy - s->plots[p].ref->vy;
-        dax = s->plots[p].sat->ax - s->plots[p].ref->ax;
-        day = s->plots[p].sat->ay - s->plots[p].ref->ay;
-        mu = G * s->plots[p].ref->mass;
+        n = 0;
+        row[n++] = s->t;
+
+        sat = sim_body(s, s->plots[p].sat);
+        ref = sim_body(s, s->plots[p].ref);
+
+        drx = sat->rx - ref->rx;
+        dry = sat->ry - ref->ry;
+        dvx = sat->vx - ref->vx;
+        dvy = sat->vy - ref->vy;
+        dax = sat->ax - ref->ax;
+        day = sat->ay - ref->ay;
+#if DIM == 3
+        drz = sat->rz - ref->rz;
+        dvz = sat->vz - ref->vz;
+        daz = sat->az - ref->az;
+#endif
+        mu = G * ref->mass;
         pl=s->plots[p].plots;
         if(pl & PLOT_POS) {
-            fprintf(s->plots[p].f, "%g %g ",drx,dry);
+            row[n++] = drx;
+            row[n++] = dry;
+            Z(row[n++] = drz;)
         }
         if(pl & PLOT_VEL) {
-            fprintf(s->plots[p].f, "%g %g ",dvx,dvy);
+            row[n++] = dvx;
+            row[n++] = dvy;
+            Z(row[n++] = dvz;)
         }
         if(pl & PLOT_ACC) {
-            fprintf(s->plots[p].f, "%g %g ",dax,day);
+            row[n++] = dax;
+            row[n++] = day;
+            Z(row[n++] = daz;)
         }
         if(pl & PLOT_ORB) {
             double d2,d,v2,v,h,ex,ey,e,a;
+            Z(double hx,hy,ez;)
 
             //determine orbital parameters from state vector
             //https://downloads.rene-schwarz.com/download/M002-Cartesian_State_Vectors_to_Keplerian_Orbit_Elements.pdf
 
             //distance of sat to central body
-            d2 = drx*drx + dry*dry;
+            d2 = drx*drx + dry*dry Z(+ drz*drz);
             d = sqrt(d2);
 
             //orbital velocity
-            v2 = dvx*dvx + dvy*dvy;
+            v2 = dvx*dvx + dvy*dvy Z(+ dvz*dvz);
             v = sqrt(v2);
 
             //orbital momentum r = R cross V -> 2D means this is a single value along Z
             h = drx * dvy - dry * dvx;
 
+#if DIM == 3
+            hx = dry * dvz - drz * dvy;
+            hy = drz * dvx - drx * dvz;
+
+            //eccentricity vector = V cross H / mu - R / |R|
+            ex = (dvy * h  - dvz * hy) / mu - drx / d;
+            ey = (dvz * hx - dvx * h ) / mu - dry / d;
+            ez = (dvx * hy - dvy * hx) / mu - drz / d;
+            e = sqrt(ex * ex + ey * ey + ez * ez);
+#else
             //eccentricity vector
             ex = ( dvy * h / mu) - drx / d;
             ey = (-dvx * h / mu) - dry / d;
             e = sqrt(ex * ex + ey * ey);
+#endif
 
             //semimajor axis
             a = 1 / ((2/d)-(v2/mu));
 
-            fprintf(s->plots[p].f, "%g %g %g %g ", d, v, e, a);
+            row[n++] = d;
+            row[n++] = v;
+            row[n++] = e;
+            row[n++] = a;
         }
-        fprintf(s->plots[p].f, "\n");
+        plot_write(s, &s->plots[p], row, n);
 
     }
     return 0;
 }
 
 /*---------------------------------------------------------------------------*/
-//[planet] name mass radius pos
-int parse_planet(struct state *dest, char *buf) {
-    double m,r;
-    char *name,*ebuf;
-    name = buf;
-    printf("PLANET =>%s\n",buf);
-    if(!*buf) {
-        printf("missing planet name");
+//copy a started simulation for independent propagation. Configuration
+//tables (atmospheres, burns) are shared, the clone has no open plot file.
+int sim_clone(struct state *dest, const struct state *src) {
+    int p;
+    *dest = *src;
+    dest->bodies = malloc(sizeof(struct body) * src->bcount);
+    dest->idx    = malloc(sizeof(uint32_t) * src->bcount);
+    dest->loc    = malloc(sizeof(uint32_t) * src->bcount);
+    if(src->encke) {
+        dest->encke = calloc(src->bcount, sizeof(struct encke));
+        if(!dest->encke) {
+            printf("clone: out of memory\n");
+            return 1;
+        }
+    }
+    dest->plots  = malloc(sizeof(struct plot) * (src->pcount + 1));
+    dest->events.ev = malloc(sizeof(struct event) * (src->events.size + 1));
+    dest->active = malloc(sizeof(int) * (src->brcount + 1));
+    if(!dest->bodies || !dest->idx || !dest->loc || !dest->plots || !dest->events.ev ||
+       !dest->active || sim_kernel_alloc(&dest->kern, src->bcount)) {
+        printf("clone: out of memory\n");
         return 1;
     }
-    //find name end
-    while(*buf && *buf !=0x20) {
-        buf += 1;
+    memcpy(dest->bodies, src->bodies, sizeof(struct body) * src->bcount);
+    memcpy(dest->idx, src->idx, sizeof(uint32_t) * src->bcount);
+    memcpy(dest->loc, src->loc, sizeof(uint32_t) * src->bcount);
+    sim_kernel_init(dest);
+    memcpy(dest->events.ev, src->events.ev, sizeof(struct event) * src->events.count);
+    memcpy(dest->active, src->active, sizeof(int) * src->actcount);
+    for(p = 0; p < src->pcount; p++) {
+        dest->plots[p] = src->plots[p];
+        dest->plots[p].f = NULL;
     }
-    ebuf = buf;
-    while(*buf && *buf==0x20) {
-        buf += 1;
+    dest->diag.nth = 0;
+    dest->para.slices = 0;
+    dest->reorder = 0; //slices are combined index by index
+    dest->clone = 1;
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+void sim_clone_end(struct state *dest) {
+    int p;
+    for(p = 0; p < dest->pcount; p++) {
+        if(dest->plots[p].f) {
+            fclose(dest->plots[p].f);
+        }
+    }
+    free(dest->plots);
+    free(dest->bodies);
+    free(dest->idx);
+    free(dest->loc);
+    free(dest->encke);
+    free(dest->events.ev);
+    free(dest->active);
+    sim_kernel_free(&dest->kern);
+}
+
+/*---------------------------------------------------------------------------*/
+//reset a clone to bodies u at t0, ready to propagate until t1 with step dt.
+//the event queue is restored from the initial simulation then seeked to t0.
+void sim_clone_load(struct state *dest, const struct state *init, const struct body *u,
+    double t0, double t1, double dt) {
+    memcpy(dest->bodies, u, sizeof(struct body) * init->bcount);
+    memcpy(dest->events.ev, init->events.ev, sizeof(struct event) * init->events.count);
+    dest->events.count = init->events.count;
+    dest->t = t0;
+    dest->tmax = t1;
+    dest->dt = dt;
+    dest->steps = (unsigned long)llround(t0 / init->dt);
+    dest->hit = 0;
+    sim_events_seek(dest, t0);
+    if(dest->encke) {
+        //references are rectified at the slice start
+        memset(dest->encke, 0, sizeof(struct encke) * init->bcount);
     }
+}
+
+struct slice {
+    struct state    st;     //fine propagator state
+    pthread_t       th;
+};
+
+/*---------------------------------------------------------------------------*/
+static void *slice_run(void *arg) {
+    struct state *s = &((struct slice*)arg)->st;
+    int p,hit;
+    //plot samples of the slice are kept aside until the solution converged
+    for(p = 0; p < s->pcount; p++) {
+        if(s->plots[p].f) {
+            fclose(s->plots[p].f);
+        }
+        s->plots[p].f = tmpfile();
+    }
+    hit = 0;
+    while(!sim_done(s)) {
+        sim_run(s);
+        //samples end with the colliding step, as a serial run would
+        if(!hit) {
+            sim_plots(s);
+        }
+        hit = s->hit;
+    }
+    return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+//largest position change between two states, each body measured relative to
+//its reference: the body it was positioned around, else the heaviest other
+//body. A ship error is then judged against its own orbit, not the system size.
+static double slice_delta(const struct body *a, const struct body *b, int n,
+    const uint32_t *idx) {
+    double dmax,dx,dy,rx,ry,d,r;
+    Z(double dz,rz;)
+    int i,j,h0,h1;
+    //two heaviest bodies, the heaviest is measured against the second one
+    h0 = h1 = -1;
+    for(i = 0; i < n; i++) {
+        if(h0 < 0 || a[i].mass > a[h0].mass) {
+            h1 = h0;
+            h0 = i;
+        } else if(h1 < 0 || a[i].mass > a[h1].mass) {
+            h1 = i;
+        }
+    }
+    dmax = 0;
+    for(i = 0; i < n; i++) {
+        if(a[i].around >= 0) {
+            j = idx[a[i].around];
+        } else {
+            j = (i == h0) ? h1 : h0;
+        }
+        if(j < 0 || j == i) {
+            continue;
+        }
+        rx = a[i].rx - a[j].rx;
+        ry = a[i].ry - a[j].ry;
+        Z(rz = a[i].rz - a[j].rz;)
+        dx = rx - (b[i].rx - b[j].rx);
+        dy = ry - (b[i].ry - b[j].ry);
+        Z(dz = rz - (b[i].rz - b[j].rz);)
+        r = rx*rx + ry*ry Z(+ rz*rz);
+        if(r == 0) {
+            continue;
+        }
+        d = (dx*dx + dy*dy Z(+ dz*dz)) / r;
+        if(d > dmax) dmax = d;
+    }
+    return sqrt(dmax);
+}
+
+/*---------------------------------------------------------------------------*/
+/**
+ * Parareal propagation: the duration is split in time slices. A cheap coarse
+ * propagator (larger step) sequentially predicts the slices start states, the
+ * fine propagator refines all slices concurrently, one thread each, then
+ * U[n+1] = G(U[n]) + F(U[n]) - Gold(U[n]) corrects the predictions. After k
+ * iterations the first k slices are exact, so only the remaining ones are
+ * refined again. Stops when start states move less than the tolerance.
+ */
+int sim_parareal(struct state *s) {
+    int n,k,i,p,ns,nb,ret,last;
+    struct slice *sl;
+    struct state coarse;
+    struct body **u,**gold,*gnew;
+    double *tn,delta,dd,dc;
+    char buf[4096];
+    double row[PLOT_MAXCOL];
+    size_t len;
+
+    ns = s->para.slices;
+    nb = s->bcount;
+    dc = s->dt * s->para.coarse;
+    ret = 1;
+    if(s->diag.nth) {
+        printf("warning: diag is not sampled in parareal mode\n");
+    }
+
+    sl   = calloc(ns, sizeof(struct slice));
+    u    = calloc(ns + 1, sizeof(struct body*));
+    gold = calloc(ns, sizeof(struct body*));
+    tn   = calloc(ns + 1, sizeof(double));
+    gnew = malloc(sizeof(struct body) * nb);
+    if(!sl || !u || !gold || !tn || !gnew || sim_clone(&coarse, s)) {
+        printf("parareal: out of memory\n");
+        return 1;
+    }
+    for(n = 0; n <= ns; n++) {
+        tn[n] = s->tmax * n / ns;
+        u[n] = malloc(sizeof(struct body) * nb);
+        if(n < ns) {
+            gold[n] = malloc(sizeof(struct body) * nb);
+            if(sim_clone(&sl[n].st, s)) {
+                return 1;
+            }
+        }
+    }
+
+    //initial coarse sweep
+    memcpy(u[0], s->bodies, sizeof(struct body) * nb);
+    for(n = 0; n < ns; n++) {
+        sim_clone_load(&coarse, s, u[n], tn[n], tn[n+1], dc);
+        while(!sim_done(&coarse)) {
+            sim_run(&coarse);
+        }
+        memcpy(gold[n], coarse.bodies, sizeof(struct body) * nb);
+        memcpy(u[n+1], coarse.bodies, sizeof(struct body) * nb);
+    }
+
+    delta = 0;
+    for(k = 0; k < s->para.maxiter && k < ns; k++) {
+        //fine propagation of the unconverged slices, concurrently
+        for(n = k; n < ns; n++) {
+            sim_clone_load(&sl[n].st, s, u[n], tn[n], tn[n+1], s->dt);
+            if(pthread_create(&sl[n].th, NULL, slice_run, &sl[n])) {
+                printf("parareal: cannot start thread\n");
+                for(i = k; i < n; i++) {
+                    pthread_join(sl[i].th, NULL);
+                }
+                goto done;
+            }
+        }
+        for(n = k; n < ns; n++) {
+            pthread_join(sl[n].th, NULL);
+        }
+
+        //sequential coarse correction, slice k start is exact now
+        delta = 0;
+        for(n = k; n < ns; n++) {
+            sim_clone_load(&coarse, s, u[n], tn[n], tn[n+1], dc);
+            while(!sim_done(&coarse)) {
+                sim_run(&coarse);
+            }
+            for(i = 0; i < nb; i++) {
+                struct body *bf = &sl[n].st.bodies[i];
+                gnew[i] = *bf;
+                gnew[i].rx = coarse.bodies[i].rx + bf->rx - gold[n][i].rx;
+                gnew[i].ry = coarse.bodies[i].ry + bf->ry - gold[n][i].ry;
+                gnew[i].vx = coarse.bodies[i].vx + bf->vx - gold[n][i].vx;
+                gnew[i].vy = coarse.bodies[i].vy + bf->vy - gold[n][i].vy;
+#if DIM == 3
+                gnew[i].rz = coarse.bodies[i].rz + bf->rz - gold[n][i].rz;
+                gnew[i].vz = coarse.bodies[i].vz + bf->vz - gold[n][i].vz;
+#endif
+            }
+            dd = slice_delta(gnew, u[n+1], nb, s->idx);
+            if(dd > delta) delta = dd;
+            memcpy(gold[n], coarse.bodies, sizeof(struct body) * nb);
+            memcpy(u[n+1], gnew, sizeof(struct body) * nb);
+        }
+        printf("parareal: iteration %d change %g\n", k + 1, delta);
+        if(delta < s->para.tol) {
+            break;
+        }
+    }
+    //once every slice start is exact the fine sweep is the serial solution
+    if(delta >= s->para.tol && k < ns) {
+        printf("parareal did not converge (change %g > tol %g)\n", delta, s->para.tol);
+    }
+
+    //the fine sweep of the last iteration is the solution, up to the first collision
+    for(last = 0; last < ns-1; last++) {
+        if(sl[last].st.hit) break;
+    }
+    memcpy(s->bodies, sl[last].st.bodies, sizeof(struct body) * nb);
+    s->t = sl[last].st.t;
+    s->steps = sl[last].st.steps;
+    if(sl[last].st.hit) {
+        printf("collision!\n");
+        s->t = s->tmax;
+    }
+    for(p = 0; p < s->pcount; p++) {
+        if(!s->plots[p].f) continue;
+        for(n = 0; n <= last; n++) {
+            FILE *f = sl[n].st.plots[p].f;
+            struct arc *a = s->plots[p].arc;
+            if(!f) continue;
+            rewind(f);
+            if(a) {
+                while(fread(row, sizeof(double), a->ncol, f) == a->ncol) {
+                    arc_append(a, s->plots[p].f, row);
+                }
+                continue;
+            }
+            while((len = fread(buf, 1, sizeof(buf), f)) > 0) {
+                fwrite(buf, 1, len, s->plots[p].f);
+            }
+        }
+    }
+    ret = 0;
+
+done:
+    for(n = 0; n <= ns; n++) {
+        free(u[n]);
+        if(n < ns) {
+            free(gold[n]);
+            sim_clone_end(&sl[n].st);
+        }
+    }
+    sim_clone_end(&coarse);
+    free(gnew);
+    free(tn);
+    free(gold);
+    free(u);
+    free(sl);
+    return ret;
+}
+
+/*---------------------------------------------------------------------------*/
+//read up to DIM coordinates, missing ones are 0, returns the count read
+static int parse_vec(char **pbuf, double *v) {
+    char *buf = *pbuf;
+    char *ebuf;
+    int i,n;
+    n = 0;
+    for(i = 0; i < DIM; i++) {
+        v[i] = 0;
+        if(!*buf) continue;
+        v[i] = strtod(buf,&ebuf);
+        if(ebuf == buf) {
+            v[i] = 0;
+            continue;
+        }
+        n += 1;
+        buf = ebuf;
+        while(*buf && *buf==0x20) {
+            buf += 1;
+        }
+    }
+    *pbuf = buf;
+    return n;
+}
+
+/*---------------------------------------------------------------------------*/
+//[planet] name mass radius [x y [z]] [vel vx vy [vz]]
+int parse_planet(struct state *dest, char *buf) {
+    double m,r,pos[DIM],vel[DIM];
+    char *name,*ebuf;
+    struct body *b;
+    int i;
+    name = buf;
+    printf("PLANET =>%s\n",buf);
+    if(!*buf) {
+        printf("missing planet name");
+        return 1;
+    }
+    //find name end
+    while(*buf && *buf !=0x20) {
+        buf += 1;
+    }
+    ebuf = buf;
+    while(*buf && *buf==0x20) {
+        buf += 1;
+    }
+    if(!*buf) {
+        printf("missing planet mass");
+        return 1;
+    }
+    *ebuf = 0; //cut name
+    m=strtod(buf,&ebuf);
+    buf = ebuf;
+    while(*buf && *buf==0x20) {
+        buf += 1;
+    }
+    if(!*buf) {
+        printf("missing planet radius");
+        return 1;
+    }
+    r=strtod(buf,&ebuf);
+    buf = ebuf;
+    while(*buf && *buf==0x20) {
+        buf += 1;
+    }
+    //optional position then velocity, z may be left out in 3D
+    parse_vec(&buf, pos);
+    for(i = 0; i < DIM; i++) {
+        vel[i] = 0;
+    }
+    if(!strncmp(buf,"vel",3) && (buf[3]==0x20 || !buf[3])) {
+        buf += 3;
+        while(*buf && *buf==0x20) {
+            buf += 1;
+        }
+        if(parse_vec(&buf, vel) < 2) {
+            printf("missing planet velocity\n");
+            return 1;
+        }
+    }
+    if(*buf) {
+        printf("warning: spurious planet info: %s\n",buf);
+    }
+
+    if(sim_body_add(dest,name,m,r)) {
+        return 1;
+    }
+    b = &dest->bodies[dest->bcount-1];
+    b->rx = pos[0];
+    b->ry = pos[1];
+    b->vx = vel[0];
+    b->vy = vel[1];
+#if DIM == 3
+    b->rz = pos[2];
+    b->vz = vel[2];
+#endif
+    printf("planet pos x=%g, y=%g vel x=%g, y=%g\n",b->rx,b->ry,b->vx,b->vy);
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+//[ship] name mass radius [around] planet alt angle orbspeed [inc degrees] [bc ballistic]
+int parse_ship(struct state *dest, char *buf) {
+    double m,r,inc;
+    char *ship,*name,*ebuf;
+    struct body *ref = NULL;
+    int ret;
+
+    ship = buf;
+    printf("SHIP =>%s\n",buf);
+    if(!*buf) {
+        printf("missing ship name");
+        return 1;
+    }
+    //find name end
+    while(*buf && *buf !=0x20) {
+        buf += 1;
+    }
+    ebuf = buf;
+    while(*buf && *buf==0x20) {
+        buf += 1;
+    }
+    if(!*buf) {
+        printf("missing ship mass");
+        return 1;
+    }
+    *ebuf = 0; //cut name
+    m=strtod(buf,&ebuf);
+    buf = ebuf;
+    while(*buf && *buf==0x20) {
+        buf += 1;
+    }
+    if(!*buf) {
+        printf("missing ship radius");
+        return 1;
+    }
+    r = strtod(buf,&ebuf);
+    buf = ebuf;
+    while(*buf && *buf==0x20) {
+        buf += 1;
+    }
+    ret = sim_body_add(dest,ship,m,r);
+    if(ret) {
+        printf("failed to add body %s\n", name);
+        return 1;
+    }
+    dest->bodies[dest->bcount-1].flags |= BODY_SHIP;
+
+    //parse 'around' alt angle
+    if(!*buf) {
+        printf("missing ship pos method");
+        return 1;
+    }
+    name = buf;
+    while(*buf && *buf!=0x20) {
+        buf += 1;
+    }
+    ebuf = buf;
+    while(*buf && *buf==0x20) {
+        buf += 1;
+    }
+    *ebuf = 0;
+    printf("pos method -> %s\n", name);
+
+    if(!strcmp(name,"around")) {
+        struct body *bship;
+        double rad,spd;
+        if(!*buf) {
+            printf("missing body around to position");
+            return 1;
+        }
+        name = buf;
+        while(*buf && *buf!=0x20) {
+            buf += 1;
+        }
+        ebuf = buf;
+        while(*buf && *buf==0x20) {
+            buf += 1;
+        }
+        if(!*buf) {
+            printf("missing altitude around body");
+            return 1;
+        }
+        *ebuf = 0;
+        printf("pos ship around body: %s\n",name);
+        ref = sim_body_find(dest,name);
+        if(!ref) {
+            printf("cannot find ref body: %s\n",name);
+            return 1;
+        }
+        rad = strtod(buf,&ebuf);
+        buf = ebuf;
+        while(*buf && *buf==0x20) {
+            buf += 1;
+        }
+        printf("at altitude %g\n",rad);
+        rad += ref->radius;
+        if(!*buf) {
+            printf("missing angle around body");
+            return 1;
+        }
+        r = strtod(buf,&ebuf);
+        buf = ebuf;
+        while(*buf && *buf==0x20) {
+            buf += 1;
+        }
+        if(!*buf) {
+            printf("missing orbital speed\n");
+            return 1;
+        }
+        printf("at mean anomaly %g\n",r);
+        spd = strtod(buf,&ebuf);
+        buf = ebuf;
+        while(*buf && *buf==0x20) {
+            buf += 1;
+        }
+        printf("orbital velo %g\n",spd);
+        bship = sim_body_find(dest,ship);
+        bship->around = ref->id;
+        bship->rx = ref->rx + rad * cos(r * M_PI / 180);
+        bship->ry = ref->ry + rad * sin(r * M_PI / 180);
+        printf("ship pos x=%g, y=%g\n",bship->rx, bship->ry);
+        bship->vx = ref->vx + spd * cos((r+90) * M_PI / 180);
+        bship->vy = ref->vy + spd * sin((r+90) * M_PI / 180);
+#if DIM == 3
+        //orbit placed in the reference XY plane, tilted below if inclined
+        bship->rz = ref->rz;
+        bship->vz = ref->vz;
+#endif
+        printf("ship vel x=%g, y=%g\n",bship->vx, bship->vy);
+    }
+
+    //optional inclination and ballistic coefficient, in any order
+    inc = 0;
+    while((!strncmp(buf,"bc",2) && (buf[2]==0x20 || !buf[2])) ||
+          (!strncmp(buf,"inc",3) && (buf[3]==0x20 || !buf[3]))) {
+        name = buf;
+        buf += (buf[0] == 'b') ? 2 : 3;
+        while(*buf && *buf==0x20) {
+            buf += 1;
+        }
+        if(!*buf) {
+            printf("missing %s value\n", name[0] == 'b' ? "ballistic coefficient" : "inclination");
+            return 1;
+        }
+        r = strtod(buf,&ebuf);
+        buf = ebuf;
+        while(*buf && *buf==0x20) {
+            buf += 1;
+        }
+        if(name[0] == 'b') {
+            printf("ballistic coefficient %g\n",r);
+            sim_body_find(dest,ship)->bc = r;
+        } else {
+            printf("inclination %g\n",r);
+            inc = r;
+        }
+    }
+    if(inc != 0) {
+        if(!ref) {
+            printf("inclination needs a ship placed around a body\n");
+            return 1;
+        }
+#if DIM == 3
+        {
+            //rotate the orbit about the reference X axis, the line of nodes
+            struct body *bship = sim_body_find(dest,ship);
+            double c = cos(inc * M_PI / 180), sn = sin(inc * M_PI / 180);
+            double y = bship->ry - ref->ry, vy = bship->vy - ref->vy;
+            bship->ry = ref->ry + y * c;
+            bship->rz = ref->rz + y * sn;
+            bship->vy = ref->vy + vy * c;
+            bship->vz = ref->vz + vy * sn;
+        }
+#else
+        printf("warning: inclination ignored in 2D builds\n");
+#endif
+    }
+
+    if(*buf) {
+        printf("warning: spurious ship info: %s\n",buf);
+    }
+
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+//[sim] timestep duration
+int parse_sim(struct state *dest, char *buf) {
+    double t,d;
+    char *ebuf;
+    printf("SIM =>%s\n",buf);
+    if(!*buf) {
+        printf("missing timestep");
+        return 1;
+    }
+    t=strtod(buf,&ebuf);
+    buf = ebuf;
+    while(*buf && *buf==0x20) {
+        buf += 1;
+    }
+    if(!*buf) {
+        printf("missing duration");
+        return 1;
+    }
+    d=strtod(buf,&ebuf);
+    buf = ebuf;
+    while(*buf && *buf==0x20) {
+        buf += 1;
+    }
+    if(*buf) {
+        printf("warning: spurious sim info: %s\n",buf);
+    }
+    dest->dt = t;
+    dest->tmax = d;
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+//[diag] nthstep
+int parse_diag(struct state *dest, char *buf) {
+    unsigned long nth;
+    char *ebuf;
+    printf("DIAG =>%s\n",buf);
     if(!*buf) {
-        printf("missing planet mass");
+        printf("missing diag nth step");
         return 1;
     }
-    *ebuf = 0; //cut name
-    m=strtod(buf,&ebuf);
+    nth=strtoul(buf,&ebuf,10);
     buf = ebuf;
     while(*buf && *buf==0x20) {
         buf += 1;
     }
-    if(!*buf) {
-        printf("missing planet radius");
+    if(*buf) {
+        printf("warning: spurious diag info: %s\n",buf);
+    }
+    dest->diag.nth = nth;
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+//resample an altitude/density table file on the atmosphere grid.
+//lines are "alt density", ascending altitudes, '#' starts a comment
+int parse_atmo_table(struct atmo *a, const char *fname) {
+    FILE *f;
+    char buf[256];
+    double *alt,*lrho,h,x;
+    int n,i,j;
+
+    f = fopen(fname, "rb");
+    if(!f) {
+        printf("cant open: %s\n", fname);
         return 1;
     }
-    r=strtod(buf,&ebuf);
-    buf = ebuf;
-    while(*buf && *buf==0x20) {
-        buf += 1;
+    alt = NULL;
+    lrho = NULL;
+    n = 0;
+    while(fgets(buf, sizeof(buf), f)) {
+        double va,vr;
+        if(buf[0] == '#') continue;
+        if(sscanf(buf, "%lf %lf", &va, &vr) != 2) continue;
+        if(vr <= 0) continue;
+        alt  = realloc(alt, sizeof(double) * (n+1));
+        lrho = realloc(lrho, sizeof(double) * (n+1));
+        alt[n]  = va;
+        lrho[n] = log(vr);
+        n += 1;
     }
-    if(*buf) {
-        printf("warning: spurious planet info: %s\n",buf);
+    fclose(f);
+    if(!n) {
+        printf("no density samples in %s\n", fname);
+        free(alt);
+        free(lrho);
+        return 1;
     }
 
-    return sim_body_add(dest,name,m,r);
+    //log-linear resampling, constant outside the table
+    j = 0;
+    for(i = 0; i <= a->n; i++) {
+        h = i / a->inv;
+        while(j < n-1 && alt[j+1] < h) {
+            j += 1;
+        }
+        if(h <= alt[0]) {
+            a->lrho[i] = lrho[0];
+        } else if(j == n-1) {
+            a->lrho[i] = lrho[n-1];
+        } else {
+            x = (h - alt[j]) / (alt[j+1] - alt[j]);
+            a->lrho[i] = lrho[j] + x * (lrho[j+1] - lrho[j]);
+        }
+    }
+    free(alt);
+    free(lrho);
+    return 0;
 }
 
 /*---------------------------------------------------------------------------*/
-//[ship] name mass radius [around] planet alt angle orbspeed
-int parse_ship(struct state *dest, char *buf) {
-    double m,r;
-    char *ship,*name,*ebuf;
-    int ret;
-
-    ship = buf;
-    printf("SHIP =>%s\n",buf);
+//[atmo] planet top step exp rho0 scaleheight
+//[atmo] planet top step table file
+int parse_atmo(struct state *dest, char *buf) {
+    char *name,*model,*ebuf;
+    double top,step,rho0,sh;
+    struct body *planet;
+    struct atmo *a;
+    int i,prev;
+
+    printf("ATMO =>%s\n",buf);
     if(!*buf) {
-        printf("missing ship name");
+        printf("missing atmosphere planet\n");
         return 1;
     }
-    //find name end
-    while(*buf && *buf !=0x20) {
+    name = buf;
+    while(*buf && *buf!=0x20) {
         buf += 1;
     }
     ebuf = buf;
     while(*buf && *buf==0x20) {
         buf += 1;
     }
+    *ebuf = 0;
+    planet = sim_body_find(dest,name);
+    if(!planet) {
+        printf("cannot find planet: %s\n",name);
+        return 1;
+    }
     if(!*buf) {
-        printf("missing ship mass");
+        printf("missing atmosphere top\n");
         return 1;
     }
-    *ebuf = 0; //cut name
-    m=strtod(buf,&ebuf);
+    top = strtod(buf,&ebuf);
     buf = ebuf;
     while(*buf && *buf==0x20) {
         buf += 1;
     }
     if(!*buf) {
-        printf("missing ship radius");
+        printf("missing atmosphere step\n");
         return 1;
     }
-    r = strtod(buf,&ebuf);
+    step = strtod(buf,&ebuf);
     buf = ebuf;
     while(*buf && *buf==0x20) {
         buf += 1;
     }
-    ret = sim_body_add(dest,ship,m,r);
-    if(ret) {
-        printf("failed to add body %s\n", name);
+    if(top <= 0 || step <= 0) {
+        printf("invalid atmosphere grid\n");
         return 1;
     }
-
-    //parse 'around' alt angle
     if(!*buf) {
-        printf("missing ship pos method");
+        printf("missing atmosphere model\n");
         return 1;
     }
-    name = buf;
+    model = buf;
     while(*buf && *buf!=0x20) {
         buf += 1;
     }
@@ -377,106 +3181,292 @@ int parse_ship(struct state *dest, char *buf) {
         buf += 1;
     }
     *ebuf = 0;
-    printf("pos method -> %s\n", name);
 
-    if(!strcmp(name,"around")) {
-        struct body *ref,*bship;
-        double rad,spd;
+    if(!strcmp(model,"exp")) {
         if(!*buf) {
-            printf("missing body around to position");
+            printf("missing ground density\n");
             return 1;
         }
-        name = buf;
-        while(*buf && *buf!=0x20) {
-            buf += 1;
-        }
-        ebuf = buf;
+        rho0 = strtod(buf,&ebuf);
+        buf = ebuf;
         while(*buf && *buf==0x20) {
             buf += 1;
         }
         if(!*buf) {
-            printf("missing altitude around body");
-            return 1;
-        }
-        *ebuf = 0;
-        printf("pos ship around body: %s\n",name);
-        ref = sim_body_find(dest,name);
-        if(!ref) {
-            printf("cannot find ref body: %s\n",name);
+            printf("missing scale height\n");
             return 1;
         }
-        rad = strtod(buf,&ebuf);
+        sh = strtod(buf,&ebuf);
         buf = ebuf;
         while(*buf && *buf==0x20) {
             buf += 1;
         }
-        printf("at altitude %g\n",rad);
-        rad += ref->radius;
-        if(!*buf) {
-            printf("missing angle around body");
+        if(rho0 <= 0 || sh <= 0) {
+            printf("invalid exponential atmosphere\n");
             return 1;
         }
-        r = strtod(buf,&ebuf);
-        buf = ebuf;
-        while(*buf && *buf==0x20) {
-            buf += 1;
+        a = sim_atmo_add(dest,planet,top,step);
+        if(!a) {
+            return 1;
+        }
+        for(i = 0; i <= a->n; i++) {
+            a->lrho[i] = log(rho0) - (i / a->inv) / sh;
         }
+    } else if(!strcmp(model,"table")) {
         if(!*buf) {
-            printf("missing orbital speed\n");
+            printf("missing table file\n");
             return 1;
         }
-        printf("at mean anomaly %g\n",r);
-        spd = strtod(buf,&ebuf);
-        buf = ebuf;
+        name = buf;
+        while(*buf && *buf!=0x20) {
+            buf += 1;
+        }
+        ebuf = buf;
         while(*buf && *buf==0x20) {
             buf += 1;
         }
-        printf("orbital velo %g\n",spd);
-        bship = sim_body_find(dest,ship);
-        bship->rx = ref->rx + rad * cos(r * M_PI / 180);
-        bship->ry = ref->ry + rad * sin(r * M_PI / 180);
-        printf("ship pos x=%g, y=%g\n",bship->rx, bship->ry);
-        bship->vx = ref->vx + spd * cos((r+90) * M_PI / 180);
-        bship->vy = ref->vy + spd * sin((r+90) * M_PI / 180);
-        printf("ship vel x=%g, y=%g\n",bship->vx, bship->vy);
+        *ebuf = 0;
+        prev = planet->atmo;
+        a = sim_atmo_add(dest,planet,top,step);
+        if(!a) {
+            return 1;
+        }
+        if(parse_atmo_table(a,name)) {
+            //never filled: drop it, the planet keeps its previous atmosphere
+            free(a->lrho);
+            dest->acount -= 1;
+            planet->atmo = prev;
+            return 1;
+        }
+    } else {
+        printf("unknown atmosphere model %s\n",model);
+        return 1;
     }
 
     if(*buf) {
-        printf("warning: spurious ship info: %s\n",buf);
+        printf("warning: spurious atmo info: %s\n",buf);
+    }
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+//[burn] ship start duration dv frame [prograde,retrograde,radial,antiradial]
+int parse_burn(struct state *dest, char *buf) {
+    char *name,*ebuf;
+    struct body *ship;
+    double start,dur,dv;
+    int frame;
+
+    printf("BURN =>%s\n",buf);
+    if(!*buf) {
+        printf("missing burn ship\n");
+        return 1;
+    }
+    name = buf;
+    while(*buf && *buf!=0x20) {
+        buf += 1;
+    }
+    ebuf = buf;
+    while(*buf && *buf==0x20) {
+        buf += 1;
+    }
+    *ebuf = 0;
+    ship = sim_body_find(dest,name);
+    if(!ship) {
+        printf("cannot find ship: %s\n",name);
+        return 1;
+    }
+    if(ship->around < 0) {
+        printf("ship %s has no reference body for burn frames\n",name);
+        return 1;
+    }
+    if(!*buf) {
+        printf("missing burn start\n");
+        return 1;
+    }
+    start = strtod(buf,&ebuf);
+    buf = ebuf;
+    while(*buf && *buf==0x20) {
+        buf += 1;
+    }
+    if(!*buf) {
+        printf("missing burn duration\n");
+        return 1;
+    }
+    dur = strtod(buf,&ebuf);
+    buf = ebuf;
+    while(*buf && *buf==0x20) {
+        buf += 1;
+    }
+    if(!*buf) {
+        printf("missing burn delta-v\n");
+        return 1;
+    }
+    dv = strtod(buf,&ebuf);
+    buf = ebuf;
+    while(*buf && *buf==0x20) {
+        buf += 1;
+    }
+    if(!*buf) {
+        printf("missing burn frame\n");
+        return 1;
+    }
+    name = buf;
+    while(*buf && *buf!=0x20) {
+        buf += 1;
+    }
+    ebuf = buf;
+    while(*buf && *buf==0x20) {
+        buf += 1;
+    }
+    *ebuf = 0;
+    if(!strcmp(name,"prograde")) {
+        frame = FRAME_PROGRADE;
+    } else if(!strcmp(name,"retrograde")) {
+        frame = FRAME_RETROGRADE;
+    } else if(!strcmp(name,"radial")) {
+        frame = FRAME_RADIAL;
+    } else if(!strcmp(name,"antiradial")) {
+        frame = FRAME_ANTIRADIAL;
+    } else {
+        printf("unknown burn frame %s\n",name);
+        return 1;
+    }
+    if(*buf) {
+        printf("warning: spurious burn info: %s\n",buf);
+    }
+    if(start < 0 || dur < 0) {
+        printf("invalid burn timing\n");
+        return 1;
+    }
+    return sim_burn_add(dest, ship->id, start, dur, dv, frame);
+}
+
+/*---------------------------------------------------------------------------*/
+//[parareal] slices coarse tol maxiter
+int parse_parareal(struct state *dest, char *buf) {
+    char *ebuf;
+    long slices,coarse,maxiter;
+    double tol;
+
+    printf("PARAREAL =>%s\n",buf);
+    if(!*buf) {
+        printf("missing slice count\n");
+        return 1;
+    }
+    slices = strtol(buf,&ebuf,10);
+    buf = ebuf;
+    while(*buf && *buf==0x20) {
+        buf += 1;
+    }
+    if(!*buf) {
+        printf("missing coarse step ratio\n");
+        return 1;
+    }
+    coarse = strtol(buf,&ebuf,10);
+    buf = ebuf;
+    while(*buf && *buf==0x20) {
+        buf += 1;
+    }
+    if(!*buf) {
+        printf("missing tolerance\n");
+        return 1;
+    }
+    tol = strtod(buf,&ebuf);
+    buf = ebuf;
+    while(*buf && *buf==0x20) {
+        buf += 1;
+    }
+    if(!*buf) {
+        printf("missing max iterations\n");
+        return 1;
+    }
+    maxiter = strtol(buf,&ebuf,10);
+    buf = ebuf;
+    while(*buf && *buf==0x20) {
+        buf += 1;
     }
+    if(*buf) {
+        printf("warning: spurious parareal info: %s\n",buf);
+    }
+    if(slices < 2 || coarse < 1 || maxiter < 1) {
+        printf("invalid parareal setup\n");
+        return 1;
+    }
+    dest->para.slices = slices;
+    dest->para.coarse = coarse;
+    dest->para.tol = tol;
+    dest->para.maxiter = maxiter;
+    return 0;
+}
 
+/*---------------------------------------------------------------------------*/
+//[encke] rectify
+int parse_encke(struct state *dest, char *buf) {
+    double r;
+    char *ebuf;
+    printf("ENCKE =>%s\n",buf);
+    if(!*buf) {
+        printf("missing rectification ratio");
+        return 1;
+    }
+    r=strtod(buf,&ebuf);
+    buf = ebuf;
+    while(*buf && *buf==0x20) {
+        buf += 1;
+    }
+    if(*buf) {
+        printf("warning: spurious encke info: %s\n",buf);
+    }
+    dest->rectify = r;
     return 0;
 }
 
 /*---------------------------------------------------------------------------*/
-//[sim] timestep duration
-int parse_sim(struct state *dest, char *buf) {
-    double t,d;
+//[reorder] nthstep
+int parse_reorder(struct state *dest, char *buf) {
+    unsigned long nth;
     char *ebuf;
-    printf("SIM =>%s\n",buf);
+    printf("REORDER =>%s\n",buf);
     if(!*buf) {
-        printf("missing timestep");
+        printf("missing reorder nth step");
         return 1;
     }
-    t=strtod(buf,&ebuf);
+    nth=strtoul(buf,&ebuf,10);
     buf = ebuf;
     while(*buf && *buf==0x20) {
         buf += 1;
     }
+    if(*buf) {
+        printf("warning: spurious reorder info: %s\n",buf);
+    }
+    dest->reorder = nth;
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+//[reg] ratio
+int parse_reg(struct state *dest, char *buf) {
+    double r;
+    char *ebuf;
+    printf("REG =>%s\n",buf);
     if(!*buf) {
-        printf("missing duration");
+        printf("missing regularization ratio\n");
         return 1;
     }
-    d=strtod(buf,&ebuf);
+    r=strtod(buf,&ebuf);
     buf = ebuf;
     while(*buf && *buf==0x20) {
         buf += 1;
     }
     if(*buf) {
-        printf("warning: spurious sim info: %s\n",buf);
+        printf("warning: spurious reg info: %s\n",buf);
     }
-    dest->dt = t;
-    dest->tmax = d;
+#if DIM == 3
+    printf("warning: Levi-Civita regularization is planar, ignored in 3D builds\n");
+    r = 0;
+#endif
+    dest->reg = r;
     return 0;
 }
 
@@ -625,6 +3615,20 @@ int parse_line(struct state *dest, char *buf) {
         return parse_sim(dest, buf);
     } else if(!strcmp(inst,"plot")) {
         return parse_plot(dest, buf);
+    } else if(!strcmp(inst,"diag")) {
+        return parse_diag(dest, buf);
+    } else if(!strcmp(inst,"reg")) {
+        return parse_reg(dest, buf);
+    } else if(!strcmp(inst,"atmo")) {
+        return parse_atmo(dest, buf);
+    } else if(!strcmp(inst,"burn")) {
+        return parse_burn(dest, buf);
+    } else if(!strcmp(inst,"parareal")) {
+        return parse_parareal(dest, buf);
+    } else if(!strcmp(inst,"reorder")) {
+        return parse_reorder(dest, buf);
+    } else if(!strcmp(inst,"encke")) {
+        return parse_encke(dest, buf);
     } else {
         printf("unknown command : %s\n", inst);
         printf("params: %s\n", buf);
@@ -701,12 +3705,37 @@ static inline void timespec_diff(struct timespec *a, struct timespec *b,
     }
 }
 
+#ifdef USE_MPI
+/*---------------------------------------------------------------------------*/
+static void dist_end(void) {
+    MPI_Finalize();
+}
+#endif
+
 /*---------------------------------------------------------------------------*/
 int main(int argc, char **argv) {
     struct timespec prev,now,diff;
 
+#ifdef USE_MPI
+    int rank,size;
+    MPI_Init(&argc, &argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    //all processes parse and check the same file, only the first one talks
+    if(rank) {
+        if(!freopen("/dev/null", "w", stdout)) {
+            return 1;
+        }
+    }
+    atexit(dist_end);
+#endif
+
+    if(argc == 5 && !strcmp(argv[1], "-x")) {
+        return arc_query(argv[2], strtod(argv[3], NULL), strtod(argv[4], NULL));
+    }
     if(argc != 2) {
         printf("%s <simfile>\n", argv[0]);
+        printf("%s -x <archive.gra> <tstart> <tend>\n", argv[0]);
         return 1;
     }
     sim_init(&sim);
@@ -720,6 +3749,15 @@ int main(int argc, char **argv) {
 
     printf("simulation start\n");
     sim_start(&sim);
+#ifdef USE_MPI
+    if(size > 1 && sim.para.slices) {
+        printf("parareal needs a single process, ignored\n");
+        sim.para.slices = 0;
+    }
+#endif
+    if(sim.para.slices) {
+        sim_parareal(&sim);
+    }
     clock_gettime(CLOCK_REALTIME, &prev);
     while(!sim_done(&sim)) {
         sim_run(&sim);
@@ -735,8 +3773,11 @@ int main(int argc, char **argv) {
         }
     }
     printf("steps %ld time %g\r",sim.steps, sim.t);
+    printf("\n");
+    sim_sync(&sim);
+    sim_diag_summary(&sim);
     sim_end(&sim);
-    printf("\nsimulation done\n");
+    printf("simulation done\n");
     return 0;
 }
 